@@ -0,0 +1,165 @@
+#include "../rules.hpp"
+#include "../proxy.hpp"
+#include "../shared_table.hpp"
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <stdio.h>
+
+// Lookup costs of the matchers every connection goes through, on a hit and
+// on a miss. Lookups are timed in batches, since a clock read costs about as
+// much as a lookup, and the 99th percentile is taken over the batches.
+
+static const size_t batch_size = 32;
+static const size_t batch_count = 20000;
+
+static std::mt19937 random_engine(1);
+
+static uint32_t random_number(uint32_t limit) {
+    return std::uniform_int_distribution<uint32_t>(0, limit - 1)(random_engine);
+}
+
+static std::string random_label() {
+    std::string label(4 + random_number(9), 'a');
+    for (char &c : label) {
+        c = 'a' + random_number(26);
+    }
+    return label;
+}
+
+static std::string random_domain() {
+    static const char *tlds[] = {"com", "net", "org", "cn", "io"};
+    return random_label() + "." + tlds[random_number(sizeof(tlds) / sizeof(tlds[0]))];
+}
+
+template <typename Lookup>
+static void run(const char *name, size_t query_count, Lookup lookup) {
+    std::vector<double> batches(batch_count);
+    uint32_t sink = 0;
+    size_t next = 0;
+    for (size_t warmup = 0; warmup < query_count; warmup++) {
+        sink += lookup(warmup);
+    }
+    for (double &batch : batches) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < batch_size; i++) {
+            sink += lookup(next);
+            next = next + 1 < query_count ? next + 1 : 0;
+        }
+        batch = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / batch_size;
+    }
+    double total = 0;
+    for (double batch : batches) {
+        total += batch;
+    }
+    std::sort(batches.begin(), batches.end());
+    printf("%-20s %8.1f ns/op  p99 %8.1f ns/op  (%u found)\n", name, total / batch_count, batches[batch_count * 99 / 100], sink);
+}
+
+static void bench_domain_set() {
+    domain_set domains;
+    std::vector<std::string> inserted;
+    for (size_t i = 0; i < 20000; i++) {
+        inserted.push_back(random_domain());
+        domains.insert(inserted.back());
+    }
+    std::vector<std::string> hits, misses;
+    while (hits.size() < 4096) {
+        hits.push_back(random_label() + "." + inserted[random_number(inserted.size())]);
+    }
+    while (misses.size() < 4096) {
+        std::string host = random_label() + "." + random_domain();
+        if (domains.find(host) == 0) {
+            misses.push_back(host);
+        }
+    }
+    run("domain_set hit", hits.size(), [&](size_t i) { return domains.find(hits[i]); });
+    run("domain_set miss", misses.size(), [&](size_t i) { return domains.find(misses[i]); });
+}
+
+static void random_address(bool ipv6, struct in6_addr &addr) {
+    if (ipv6) {
+        for (uint8_t &byte : addr.s6_addr) {
+            byte = random_number(256);
+        }
+        addr.s6_addr[0] = 0x20 | random_number(2);
+    } else {
+        struct in_addr addr_v4;
+        addr_v4.s_addr = htonl(random_number(0xe0000000));
+        network_set::map(addr_v4, addr);
+    }
+}
+
+static void bench_network_set(bool ipv6) {
+    network_set networks;
+    std::vector<std::pair<struct in6_addr, size_t>> inserted;
+    for (size_t i = 0; i < 5000; i++) {
+        struct in6_addr addr;
+        random_address(ipv6, addr);
+        size_t prefix_len = ipv6 ? 32 + random_number(33) : 96 + 8 + random_number(17);
+        networks.insert(addr, prefix_len);
+        inserted.push_back(std::make_pair(addr, prefix_len));
+    }
+    std::vector<struct in6_addr> hits, misses;
+    while (hits.size() < 4096) {
+        // a random host inside a random inserted network
+        const std::pair<struct in6_addr, size_t> &network = inserted[random_number(inserted.size())];
+        struct in6_addr addr;
+        random_address(ipv6, addr);
+        for (size_t bit = 0; bit < network.second; bit++) {
+            uint8_t mask = 0x80 >> (bit % 8);
+            addr.s6_addr[bit / 8] = (addr.s6_addr[bit / 8] & ~mask) | (network.first.s6_addr[bit / 8] & mask);
+        }
+        hits.push_back(addr);
+    }
+    while (misses.size() < 4096) {
+        struct in6_addr addr;
+        random_address(ipv6, addr);
+        if (networks.find(addr) == 0) {
+            misses.push_back(addr);
+        }
+    }
+    run(ipv6 ? "network_set v6 hit" : "network_set v4 hit", hits.size(), [&](size_t i) { return networks.find(hits[i]); });
+    run(ipv6 ? "network_set v6 miss" : "network_set v4 miss", misses.size(), [&](size_t i) { return networks.find(misses[i]); });
+}
+
+static void bench_proxy_cache() {
+    // the size skia gives its decision cache, filled halfway so nothing is dropped
+    proxy_cache cache(4096);
+    proxy_list proxies;
+    proxies.push(proxy_address());
+    // keys with their hashes, which skia keeps along with the names
+    std::vector<std::pair<std::string, uint32_t>> hits, misses;
+    for (size_t i = 0; i < 2048; i++) {
+        std::string host = random_domain();
+        hits.push_back(std::make_pair(host, shared_table::hash(host.c_str(), host.length())));
+        cache.insert(host.c_str(), host.length(), hits.back().second, 443, proxies, 0);
+    }
+    while (misses.size() < 2048) {
+        std::string host = random_domain();
+        uint32_t host_hash = shared_table::hash(host.c_str(), host.length());
+        proxy_list found;
+        if (!cache.find(host.c_str(), host.length(), host_hash, 443, found)) {
+            misses.push_back(std::make_pair(host, host_hash));
+        }
+    }
+    run("proxy_cache hit", hits.size(), [&](size_t i) {
+        proxy_list found;
+        return static_cast<uint32_t>(cache.find(hits[i].first.c_str(), hits[i].first.length(), hits[i].second, 443, found));
+    });
+    run("proxy_cache miss", misses.size(), [&](size_t i) {
+        proxy_list found;
+        return static_cast<uint32_t>(cache.find(misses[i].first.c_str(), misses[i].first.length(), misses[i].second, 443, found));
+    });
+    proxy_cache::counters totals = cache.totals();
+    printf("proxy_cache          %llu hits, %llu misses, %llu evictions\n", static_cast<unsigned long long>(totals.hits), static_cast<unsigned long long>(totals.misses), static_cast<unsigned long long>(totals.evictions));
+}
+
+int main() {
+    bench_domain_set();
+    bench_network_set(false);
+    bench_network_set(true);
+    bench_proxy_cache();
+    return 0;
+}
@@ -1,8 +1,155 @@
 #include "config.hpp"
+#include "health_table.hpp"
+#include <vector>
+#include <chrono>
 #include <substrate.h>
 
-void config::create_context() {
-    script_context = JSGlobalContextCreate(NULL);
+std::string string_value(JSContextRef context, JSValueRef value) {
+    JSStringRef string = JSValueToStringCopy(context, value, NULL);
+    if (string == NULL) {
+        return std::string();
+    }
+    char buffer[1024];
+    std::vector<char> large_buffer;
+    char *data = buffer;
+    size_t size = JSStringGetMaximumUTF8CStringSize(string);
+    if (size > sizeof(buffer)) {
+        large_buffer.resize(size);
+        data = large_buffer.data();
+    } else {
+        size = sizeof(buffer);
+    }
+    JSStringGetUTF8CString(string, data, size);
+    JSStringRelease(string);
+    return data;
+}
+
+// DomainSet and NetworkSet share one implementation, differing only in the
+// native set they wrap.
+template <typename T> static const char *set_name();
+template <> const char *set_name<domain_set>() { return "DomainSet"; }
+template <> const char *set_name<network_set>() { return "NetworkSet"; }
+
+template <typename T> static void set_add_values(JSContextRef context, T *set, size_t argumentCount, const JSValueRef arguments[]) {
+    for (size_t i = 0; i < argumentCount; i++) {
+        if (JSValueIsObject(context, arguments[i])) {
+            JSObjectRef array = JSValueToObject(context, arguments[i], NULL);
+            JSStringRef length_property = JSStringCreateWithUTF8CString("length");
+            size_t length = JSValueToNumber(context, JSObjectGetProperty(context, array, length_property, NULL), NULL);
+            JSStringRelease(length_property);
+            for (size_t j = 0; j < length; j++) {
+                set->insert(string_value(context, JSObjectGetPropertyAtIndex(context, array, static_cast<unsigned>(j), NULL)));
+            }
+        } else if (JSValueIsString(context, arguments[i])) {
+            set->insert(string_value(context, arguments[i]));
+        }
+    }
+}
+
+template <typename T> static JSValueRef set_add(JSContextRef context, JSObjectRef function, JSObjectRef thisObject, size_t argumentCount, const JSValueRef arguments[], JSValueRef *exception) {
+    T *set = reinterpret_cast<T *>(JSObjectGetPrivate(thisObject));
+    if (set != NULL) {
+        set_add_values(context, set, argumentCount, arguments);
+    }
+    return JSValueMakeUndefined(context);
+}
+
+template <typename T> static JSValueRef set_contains(JSContextRef context, JSObjectRef function, JSObjectRef thisObject, size_t argumentCount, const JSValueRef arguments[], JSValueRef *exception) {
+    T *set = reinterpret_cast<T *>(JSObjectGetPrivate(thisObject));
+    if (set == NULL || argumentCount < 1 || !JSValueIsString(context, arguments[0])) {
+        return JSValueMakeBoolean(context, false);
+    }
+    return JSValueMakeBoolean(context, set->find(string_value(context, arguments[0])) != 0);
+}
+
+template <typename T> static void set_finalize(JSObjectRef object) {
+    delete reinterpret_cast<T *>(JSObjectGetPrivate(object));
+}
+
+template <typename T> static JSClassRef set_class();
+
+template <typename T> static JSObjectRef set_construct(JSContextRef context, JSObjectRef constructor, size_t argumentCount, const JSValueRef arguments[], JSValueRef *exception) {
+    T *set = new T();
+    set_add_values(context, set, argumentCount, arguments);
+    return JSObjectMake(context, set_class<T>(), set);
+}
+
+template <typename T> static JSClassRef set_class() {
+    static const JSStaticFunction functions[] = {
+        {"add", set_add<T>, kJSPropertyAttributeReadOnly | kJSPropertyAttributeDontDelete},
+        {"contains", set_contains<T>, kJSPropertyAttributeReadOnly | kJSPropertyAttributeDontDelete},
+        {NULL, NULL, 0},
+    };
+    static JSClassRef object_class = [] {
+        JSClassDefinition definition = kJSClassDefinitionEmpty;
+        definition.className = set_name<T>();
+        definition.staticFunctions = functions;
+        definition.finalize = set_finalize<T>;
+        return JSClassCreate(&definition);
+    }();
+    return object_class;
+}
+
+template <typename T> static void register_set(JSGlobalContextRef context) {
+    JSStringRef class_name = JSStringCreateWithUTF8CString(set_name<T>());
+    JSObjectRef constructor_object = JSObjectMakeConstructor(context, set_class<T>(), set_construct<T>);
+    JSObjectSetProperty(context, JSContextGetGlobalObject(context), class_name, constructor_object, 0, NULL);
+    JSStringRelease(class_name);
+}
+
+// __skia_proxyHealth(host, port) returns the latest check of a proxy by skiad
+// as {rtt, failures, checked}, or null when it has not been checked.
+static JSValueRef proxy_health_function(JSContextRef context, JSObjectRef function, JSObjectRef thisObject, size_t argumentCount, const JSValueRef arguments[], JSValueRef *exception) {
+    static std::atomic<health_table *> shared_table(NULL);
+    static std::atomic<int64_t> next_map(0); // seconds of the steady clock
+    static const int64_t map_retry_sec = 5;
+    health_table *table = shared_table.load(std::memory_order_acquire);
+    if (table == NULL) {
+        // skiad may not have created the file yet, which is tried again at
+        // most once every few seconds rather than on every call
+        int64_t now = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        int64_t next = next_map.load(std::memory_order_relaxed);
+        if (now < next || !next_map.compare_exchange_strong(next, now + map_retry_sec, std::memory_order_relaxed)) {
+            return JSValueMakeNull(context);
+        }
+        health_table *new_table = health_table::map(false);
+        if (new_table == NULL) {
+            return JSValueMakeNull(context);
+        }
+        if (shared_table.compare_exchange_strong(table, new_table, std::memory_order_acq_rel)) {
+            table = new_table;
+        } else {
+            munmap(new_table, sizeof(health_table));
+        }
+    }
+    struct in_addr addr;
+    if (argumentCount < 2 || inet_aton(string_value(context, arguments[0]).c_str(), &addr) != 1) {
+        return JSValueMakeNull(context);
+    }
+    const health_table::entry *e = table->find(addr.s_addr, htons(static_cast<uint16_t>(JSValueToNumber(context, arguments[1], NULL))));
+    if (e == NULL || e->checked.load(std::memory_order_relaxed) == 0) {
+        return JSValueMakeNull(context);
+    }
+    uint32_t rtt_usec = e->rtt_usec.load(std::memory_order_relaxed);
+    const struct {
+        const char *name;
+        double value;
+    } properties[] = {
+        {"rtt", rtt_usec != 0 ? rtt_usec / 1000.0 : -1},
+        {"failures", static_cast<double>(e->failures.load(std::memory_order_relaxed))},
+        {"checked", static_cast<double>(e->checked.load(std::memory_order_relaxed))},
+    };
+    JSObjectRef result = JSObjectMake(context, NULL, NULL);
+    for (const auto &property : properties) {
+        JSStringRef property_name = JSStringCreateWithUTF8CString(property.name);
+        JSObjectSetProperty(context, result, property_name, JSValueMakeNumber(context, property.value), 0, NULL);
+        JSStringRelease(property_name);
+    }
+    return result;
+}
+
+JSGlobalContextRef config::create_context() {
+    JSGlobalContextRef script_context = JSGlobalContextCreate(NULL);
     for (const auto &native_function : native_functions) {
         JSStringRef function_name = JSStringCreateWithUTF8CString(native_function.first.c_str());
         JSObjectCallAsFunctionCallback function_callback = reinterpret_cast<JSObjectCallAsFunctionCallback>(MSFindSymbol(NULL, native_function.second.c_str()));
@@ -10,17 +157,53 @@ void config::create_context() {
         JSObjectSetProperty(script_context, JSContextGetGlobalObject(script_context), function_name, function_object, 0, NULL);
         JSStringRelease(function_name);
     }
+    JSStringRef health_function_name = JSStringCreateWithUTF8CString("__skia_proxyHealth");
+    JSObjectRef health_function_object = JSObjectMakeFunctionWithCallback(script_context, health_function_name, proxy_health_function);
+    JSObjectSetProperty(script_context, JSContextGetGlobalObject(script_context), health_function_name, health_function_object, 0, NULL);
+    JSStringRelease(health_function_name);
+    register_set<domain_set>(script_context);
+    register_set<network_set>(script_context);
     JSStringRef support_script = read_script("/Library/PreferenceBundles/skiapref.bundle/proxy.js");
     JSEvaluateScript(script_context, support_script, NULL, NULL, 0, NULL);
     JSStringRelease(support_script);
     JSStringRef config_script = read_script("/User/Library/Preferences/me.qusic.skia.js");
     JSEvaluateScript(script_context, config_script, NULL, NULL, 0, NULL);
     JSStringRelease(config_script);
+    return script_context;
 }
 
-void config::release_context() {
-    JSGlobalContextRelease(script_context);
-    script_context = NULL;
+void config::release_contexts() {
+    for (size_t i = 0; i < context_count; i++) {
+        context_mutexes[i].lock();
+        JSGlobalContextRelease(script_contexts[i]);
+        script_contexts[i] = NULL;
+        context_mutexes[i].unlock();
+    }
+    context_count = 0;
+}
+
+size_t config::acquire_context() {
+    size_t count = context_count.load(std::memory_order_acquire);
+    size_t start = next_context++;
+    for (size_t i = 0; i < count; i++) {
+        size_t index = (start + i) % count;
+        if (context_mutexes[index].try_lock()) {
+            return index;
+        }
+    }
+    if (count < pool_size) {
+        std::unique_lock<std::mutex> lock(pool_mutex);
+        count = context_count.load(std::memory_order_acquire);
+        if (count < pool_size) {
+            script_contexts[count] = create_context();
+            context_mutexes[count].lock();
+            context_count.store(count + 1, std::memory_order_release);
+            return count;
+        }
+    }
+    size_t index = start % count;
+    context_mutexes[index].lock();
+    return index;
 }
 
 JSStringRef config::read_script(const std::string &file) {
@@ -56,7 +239,14 @@ JSStringRef config::read_script(const std::string &file) {
 }
 
 void config::execute(const std::function<void(JSGlobalContextRef)> &code) {
-    code(script_context);
+    size_t index = acquire_context();
+    try {
+        code(script_contexts[index]);
+    } catch (...) {
+        context_mutexes[index].unlock();
+        throw;
+    }
+    context_mutexes[index].unlock();
 }
 
 std::string config::evaluate(const std::string &code) {
@@ -1,22 +1,40 @@
 #include <string>
 #include <unordered_map>
 #include <functional>
+#include <memory>
+#include <atomic>
+#include <mutex>
 #include <CoreFoundation/CoreFoundation.h>
 #include <JavaScriptCore/JavaScriptCore.h>
+#include "rules.hpp"
 
 class config {
 private:
-    JSGlobalContextRef script_context;
+    // Every context is created in its own context group, so they run in parallel.
+    // Contexts are added on demand, up to pool_size, when all existing ones are busy.
+    const size_t pool_size;
+    std::unique_ptr<JSGlobalContextRef[]> script_contexts;
+    std::unique_ptr<std::mutex[]> context_mutexes;
+    std::atomic<size_t> context_count;
+    std::atomic<size_t> next_context;
+    std::mutex pool_mutex;
     const std::unordered_map<std::string, std::string> native_functions = {
         {"__skia_primaryAddresses", "__ZL39_JSPrimaryIpv4AddressesFunctionCallbackPK15OpaqueJSContextP13OpaqueJSValueS3_mPKPKS2_PS5_"},
         {"__skia_dnsResolve", "__ZL29_JSDnsResolveFunctionCallbackPK15OpaqueJSContextP13OpaqueJSValueS3_mPKPKS2_PS5_"},
     };
-    void create_context();
-    void release_context();
+    JSGlobalContextRef create_context();
+    void release_contexts();
+    size_t acquire_context();
     JSStringRef read_script(const std::string &file);
 public:
-    config() { create_context(); }
-    ~config() { release_context(); }
+    config(size_t pool_size = 1): pool_size(pool_size), script_contexts(new JSGlobalContextRef[pool_size]()), context_mutexes(new std::mutex[pool_size]), context_count(0), next_context(0) {
+        script_contexts[0] = create_context();
+        context_count = 1;
+    }
+    ~config() { release_contexts(); }
     void execute(const std::function<void(JSGlobalContextRef)> &code);
     std::string evaluate(const std::string &code);
 };
+
+// The value converted to a string as JavaScript does, empty when that fails.
+std::string string_value(JSContextRef context, JSValueRef value);
@@ -0,0 +1,97 @@
+#include <atomic>
+#include <stdio.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define HealthTableFile "/var/tmp/me.qusic.skia.health"
+
+// Results of the periodic proxy checks run by skiad, published through a
+// memory mapped file that injected processes and the preferences read. skiad
+// is the only writer. Fields are updated one by one, so a reader may see a
+// check half applied, which is harmless for picking a proxy.
+struct health_table {
+    struct entry {
+        std::atomic<uint32_t> addr; // network byte order, 0 for an unused entry
+        std::atomic<uint32_t> port; // network byte order
+        std::atomic<uint32_t> rtt_usec; // moving average of successful checks, 0 before the first
+        std::atomic<uint32_t> failures; // consecutive failed checks
+        std::atomic<uint32_t> checked; // seconds since epoch of the last check
+    };
+    static const uint32_t magic_value = 0x736b6968;
+    static const uint32_t entry_count = 64;
+    std::atomic<uint32_t> magic;
+    uint32_t capacity;
+    entry entries[entry_count];
+
+    entry *find(uint32_t addr, uint32_t port) {
+        for (entry &e : entries) {
+            if (e.addr.load(std::memory_order_relaxed) == addr && e.port.load(std::memory_order_relaxed) == port) {
+                return &e;
+            }
+        }
+        return NULL;
+    }
+    const entry *find(uint32_t addr, uint32_t port) const {
+        return const_cast<health_table *>(this)->find(addr, port);
+    }
+
+    // skiad keeps a valid file it owns and otherwise builds a new one, moved
+    // in place with rename, so it never writes through a file somebody else
+    // created. Everyone else only maps an existing valid file that only its
+    // owner can write, and that owner has to be root, which skiad runs as.
+    static health_table *map(bool create) {
+        int fd = open(HealthTableFile, create ? O_RDWR : O_RDONLY);
+        struct stat file_stat;
+        if (fd != -1 && fstat(fd, &file_stat) != 0) {
+            close(fd);
+            fd = -1;
+        }
+        if (fd != -1 && (file_stat.st_size != sizeof(health_table) || (file_stat.st_mode & 022) != 0 || file_stat.st_uid != (create ? geteuid() : 0))) {
+            close(fd);
+            fd = -1;
+        }
+        if (fd == -1 && !create) {
+            return NULL;
+        }
+        if (create && fd != -1) {
+            uint32_t header[2] = {0, 0};
+            if (pread(fd, header, sizeof(header), 0) != sizeof(header) || header[0] != magic_value || header[1] != entry_count) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        bool created = false;
+        if (create && fd == -1) {
+            const char *new_file = HealthTableFile ".new";
+            unlink(new_file);
+            fd = open(new_file, O_RDWR | O_CREAT | O_EXCL, 0644);
+            if (fd == -1) {
+                return NULL;
+            }
+            if (fchmod(fd, 0644) != 0 || ftruncate(fd, sizeof(health_table)) != 0 || rename(new_file, HealthTableFile) != 0) {
+                close(fd);
+                unlink(new_file);
+                return NULL;
+            }
+            created = true;
+        }
+        void *memory = mmap(NULL, sizeof(health_table), create ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (memory == MAP_FAILED) {
+            return NULL;
+        }
+        health_table *table = reinterpret_cast<health_table *>(memory);
+        if (created) {
+            table->capacity = entry_count;
+            table->magic.store(magic_value, std::memory_order_release);
+        }
+        if (table->magic.load(std::memory_order_acquire) != magic_value || table->capacity != entry_count) {
+            munmap(memory, sizeof(health_table));
+            return NULL;
+        }
+        return table;
+    }
+};
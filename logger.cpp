@@ -0,0 +1,229 @@
+#include "logger.hpp"
+#include <mutex>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <ctype.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+std::atomic<int> logger::level(LOG_NOTICE);
+std::atomic<uint32_t> logger::sample(1);
+std::atomic<uint32_t> logger::rate(20);
+
+namespace {
+
+const uint32_t ring_size = 32;
+const useconds_t drain_usec = 100000;
+
+// Records of one thread, which moves the head while the drain thread moves the
+// tail. A ring outlives its thread until the drain thread has emptied it.
+struct ring {
+    std::atomic<uint32_t> head;
+    std::atomic<uint32_t> tail;
+    std::atomic<bool> retired;
+    logger::record records[ring_size];
+};
+
+std::once_flag start_once;
+pthread_key_t ring_key;
+std::mutex rings_mutex;
+std::vector<ring *> *rings;
+std::atomic<uint32_t> dropped(0);
+
+void emit(const logger::record &r) {
+    char buffer[1024];
+    size_t length = logger::format(r, buffer, sizeof(buffer));
+    if (r.suppressed != 0 && length < sizeof(buffer)) {
+        snprintf(buffer + length, sizeof(buffer) - length, " (%u similar suppressed)", r.suppressed);
+    }
+    syslog(r.level, "Skia: %s", buffer);
+}
+
+void drain() {
+    while (true) {
+        usleep(drain_usec);
+        std::vector<ring *> current;
+        {
+            std::lock_guard<std::mutex> lock(rings_mutex);
+            current = *rings;
+        }
+        for (ring *r : current) {
+            bool retired = r->retired.load(std::memory_order_acquire);
+            uint32_t head = r->head.load(std::memory_order_acquire);
+            uint32_t tail = r->tail.load(std::memory_order_relaxed);
+            for (; tail != head; tail++) {
+                emit(r->records[tail % ring_size]);
+                r->tail.store(tail + 1, std::memory_order_release);
+            }
+            if (retired) {
+                std::lock_guard<std::mutex> lock(rings_mutex);
+                rings->erase(std::remove(rings->begin(), rings->end(), r), rings->end());
+                delete r;
+            }
+        }
+        uint32_t lost = dropped.exchange(0, std::memory_order_relaxed);
+        if (lost != 0) {
+            syslog(LOG_ERR, "Skia: logging fell behind, %u records dropped", lost);
+        }
+    }
+}
+
+void retire(void *data) {
+    reinterpret_cast<ring *>(data)->retired.store(true, std::memory_order_release);
+}
+
+ring *thread_ring() {
+    std::call_once(start_once, []() {
+        rings = new std::vector<ring *>();
+        pthread_key_create(&ring_key, retire);
+        std::thread(drain).detach();
+    });
+    ring *r = reinterpret_cast<ring *>(pthread_getspecific(ring_key));
+    if (r == NULL) {
+        r = new ring(); // value initialized, so the ring starts empty
+        std::lock_guard<std::mutex> lock(rings_mutex);
+        rings->push_back(r);
+        pthread_setspecific(ring_key, r);
+    }
+    return r;
+}
+
+int64_t current_second() {
+    return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+}
+
+logger::record *logger::admit(log_site &site, int priority) {
+    uint32_t limit = rate.load(std::memory_order_relaxed);
+    if (limit != 0) {
+        int64_t now = current_second();
+        int64_t window = site.window.load(std::memory_order_relaxed);
+        if (window != now && site.window.compare_exchange_strong(window, now, std::memory_order_relaxed)) {
+            site.count.store(0, std::memory_order_relaxed);
+        }
+    }
+    uint32_t seen = site.count.fetch_add(1, std::memory_order_relaxed);
+    uint32_t every = priority < LOG_WARNING ? 1 : std::max(sample.load(std::memory_order_relaxed), 1u);
+    if (seen % every != 0 || (limit != 0 && seen / every >= limit)) {
+        site.suppressed.fetch_add(1, std::memory_order_relaxed);
+        return NULL;
+    }
+    ring *r = thread_ring();
+    uint32_t head = r->head.load(std::memory_order_relaxed);
+    if (head - r->tail.load(std::memory_order_acquire) >= ring_size) {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return NULL;
+    }
+    record &rec = r->records[head % ring_size];
+    rec.site = &site;
+    rec.suppressed = site.suppressed.exchange(0, std::memory_order_relaxed);
+    return &rec;
+}
+
+void logger::commit() {
+    ring *r = reinterpret_cast<ring *>(pthread_getspecific(ring_key));
+    r->head.store(r->head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+size_t logger::format(const record &r, char *buffer, size_t size) {
+    size_t length = 0, offset = 0;
+    uint8_t index = 0;
+    auto output = [&](const char *spec, auto... value) {
+        int written = snprintf(buffer + std::min(length, size - 1), length < size ? size - length : 1, spec, value...);
+        length += written > 0 ? written : 0;
+    };
+    for (const char *p = r.site->format; *p != '\0';) {
+        if (*p != '%' || p[1] == '%') {
+            if (length + 1 < size) {
+                buffer[length] = *p;
+            }
+            length++;
+            p += *p == '%' ? 2 : 1;
+            continue;
+        }
+        // flags, width and precision are kept, the length modifier follows
+        // the stored argument instead
+        char spec[32] = "%";
+        size_t spec_len = 1;
+        for (p++; *p != '\0' && (strchr("-+ #0.", *p) != NULL || isdigit(*p)); p++) {
+            if (spec_len < 16) {
+                spec[spec_len++] = *p;
+            }
+        }
+        while (*p != '\0' && strchr("hljztqL", *p) != NULL) {
+            p++;
+        }
+        char conversion = *p;
+        if (conversion == '\0') {
+            break;
+        }
+        p++;
+        if (index >= r.count) {
+            output("%s", "(missing)");
+            continue;
+        }
+        const char *payload = r.payload + offset;
+        switch (r.kinds[index++]) {
+            case kind_signed: {
+                int64_t value;
+                memcpy(&value, payload, sizeof(value));
+                offset += sizeof(value);
+                strcpy(spec + spec_len, "ll");
+                spec[spec_len + 2] = strchr("diouxX", conversion) != NULL ? conversion : 'd';
+                output(spec, static_cast<long long>(value));
+                break;
+            }
+            case kind_unsigned: {
+                uint64_t value;
+                memcpy(&value, payload, sizeof(value));
+                offset += sizeof(value);
+                strcpy(spec + spec_len, "ll");
+                spec[spec_len + 2] = strchr("diouxX", conversion) != NULL ? conversion : 'u';
+                output(spec, static_cast<unsigned long long>(value));
+                break;
+            }
+            case kind_double: {
+                double value;
+                memcpy(&value, payload, sizeof(value));
+                offset += sizeof(value);
+                spec[spec_len] = strchr("fFeEgGaA", conversion) != NULL ? conversion : 'g';
+                output(spec, value);
+                break;
+            }
+            case kind_pointer: {
+                uintptr_t value;
+                memcpy(&value, payload, sizeof(value));
+                offset += sizeof(value);
+                output("%p", reinterpret_cast<void *>(value));
+                break;
+            }
+            case kind_string: {
+                uint16_t value_len;
+                memcpy(&value_len, payload, sizeof(value_len));
+                offset += sizeof(value_len) + value_len;
+                char value[payload_size + 1];
+                memcpy(value, payload + sizeof(value_len), value_len);
+                value[value_len] = '\0';
+                spec[spec_len] = 's';
+                output(spec, value);
+                break;
+            }
+            case kind_inet4:
+            case kind_inet6: {
+                bool ipv6 = r.kinds[index - 1] == kind_inet6;
+                char value[INET6_ADDRSTRLEN];
+                inet_ntop(ipv6 ? AF_INET6 : AF_INET, payload, value, sizeof(value));
+                offset += ipv6 ? sizeof(struct in6_addr) : sizeof(struct in_addr);
+                spec[spec_len] = 's';
+                output(spec, value);
+                break;
+            }
+        }
+    }
+    buffer[std::min(length, size - 1)] = '\0';
+    return std::min(length, size - 1);
+}
@@ -0,0 +1,167 @@
+#include <atomic>
+#include <algorithm>
+#include <string>
+#include <type_traits>
+#include <stdint.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <sys/syslog.h>
+
+// Least severe level compiled in, calls for the levels below it compile away.
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_INFO
+#endif
+
+#define log_(level, format, args...) ({ \
+    static log_site log_site_ = {format}; \
+    if (LOG_##level <= LOG_LEVEL && logger::enabled(LOG_##level)) { \
+        logger::write(log_site_, LOG_##level, ##args); \
+    } \
+})
+#define log(format, args...) log_(NOTICE, format, ##args)
+#define info(format, args...) log_(INFO, format, ##args)
+#define err(format, args...) log_(ERR, format, ##args)
+
+// One call site of the log macros, which owns its rate limit.
+struct log_site {
+    const char *format;
+    std::atomic<int64_t> window; // second the count belongs to
+    std::atomic<uint32_t> count; // records seen in that second
+    std::atomic<uint32_t> suppressed; // records dropped since the last emitted one
+};
+
+// A host that is either a name or an address, rendered by %s.
+struct log_host {
+    const char *name;
+    struct in6_addr addr;
+    bool ipv6;
+};
+
+// Log calls copy their arguments into a fixed size record on a ring owned by
+// the calling thread, and a background thread formats the records and hands
+// them to syslog, so connecting threads neither format nor block on syslog.
+// Strings are copied as they are and addresses are kept binary until a record
+// is emitted. Each call site is limited to a number of records per second and
+// may be sampled below the error level, and what gets left out is counted on
+// the next record the site emits. A full ring drops records.
+class logger {
+public:
+    enum kind: uint8_t {
+        kind_signed,
+        kind_unsigned,
+        kind_double,
+        kind_pointer,
+        kind_string,
+        kind_inet4,
+        kind_inet6,
+    };
+    static const size_t argument_count = 8;
+    static const size_t payload_size = 208;
+    struct record {
+        const log_site *site;
+        uint32_t suppressed;
+        uint16_t length;
+        uint8_t level;
+        uint8_t count;
+        kind kinds[argument_count];
+        char payload[payload_size];
+    };
+    // levels less severe than this are dropped at runtime
+    static std::atomic<int> level;
+    // every site below the error level emits one record in this many
+    static std::atomic<uint32_t> sample;
+    // records a single site emits per second, 0 for no limit
+    static std::atomic<uint32_t> rate;
+
+    static bool enabled(int priority) {
+        return priority <= level.load(std::memory_order_relaxed);
+    }
+
+    template <typename... Args>
+    static void write(log_site &site, int priority, const Args &...args) {
+        record *r = admit(site, priority);
+        if (r == NULL) {
+            return;
+        }
+        r->level = static_cast<uint8_t>(priority);
+        r->count = 0;
+        r->length = 0;
+        int expand[] = {0, (put(*r, args), 0)...};
+        (void)expand;
+        commit();
+    }
+
+    // Renders the arguments of a record into its format, snprintf style.
+    static size_t format(const record &r, char *buffer, size_t size);
+
+private:
+    static record *admit(log_site &site, int priority);
+    static void commit();
+
+    static bool reserve(record &r, kind k, size_t length) {
+        if (r.count >= argument_count || r.length + length > payload_size) {
+            return false;
+        }
+        r.kinds[r.count++] = k;
+        return true;
+    }
+    template <typename T>
+    static void append(record &r, kind k, const T &value) {
+        if (reserve(r, k, sizeof(T))) {
+            memcpy(r.payload + r.length, &value, sizeof(T));
+            r.length += sizeof(T);
+        }
+    }
+    static void append_string(record &r, const char *string, size_t length) {
+        if (r.length + sizeof(uint16_t) >= payload_size) {
+            return;
+        }
+        uint16_t stored = static_cast<uint16_t>(std::min(length, payload_size - r.length - sizeof(uint16_t)));
+        if (reserve(r, kind_string, sizeof(uint16_t) + stored)) {
+            memcpy(r.payload + r.length, &stored, sizeof(uint16_t));
+            memcpy(r.payload + r.length + sizeof(uint16_t), string, stored);
+            r.length += sizeof(uint16_t) + stored;
+        }
+    }
+
+    template <typename T>
+    static typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type put(record &r, const T &value) {
+        if (std::is_signed<T>::value) {
+            append(r, kind_signed, static_cast<int64_t>(value));
+        } else {
+            append(r, kind_unsigned, static_cast<uint64_t>(value));
+        }
+    }
+    template <typename T>
+    static typename std::enable_if<std::is_floating_point<T>::value>::type put(record &r, const T &value) {
+        append(r, kind_double, static_cast<double>(value));
+    }
+    template <typename T>
+    static void put(record &r, T *const &value) {
+        append(r, kind_pointer, reinterpret_cast<uintptr_t>(value));
+    }
+    static void put(record &r, const char *const &value) {
+        append_string(r, value ?: "(null)", value ? strlen(value) : 6);
+    }
+    static void put(record &r, char *const &value) {
+        put(r, static_cast<const char *>(value));
+    }
+    static void put(record &r, const std::string &value) {
+        append_string(r, value.data(), value.length());
+    }
+    static void put(record &r, const struct in_addr &value) {
+        append(r, kind_inet4, value);
+    }
+    static void put(record &r, const struct in6_addr &value) {
+        append(r, kind_inet6, value);
+    }
+    static void put(record &r, const log_host &value) {
+        if (value.name != NULL) {
+            put(r, value.name);
+        } else if (value.ipv6) {
+            put(r, value.addr);
+        } else {
+            put(r, *reinterpret_cast<const struct in_addr *>(&value.addr));
+        }
+    }
+};
@@ -70,7 +70,9 @@ static socket_address proxy_for_endpoint(nw_endpoint_t endpoint) {
             return proxy;
         }
         char buffer[INET6_ADDRSTRLEN];
-        if (inet_ntop(af, &address, buffer, sizeof(buffer)) != NULL) {
+        if (resolve_table::instance().is_resolved_addr(address, ipv6)) {
+            name = resolve_table::instance().addr_to_name(address, ipv6).str();
+        } else if (inet_ntop(af, &address, buffer, sizeof(buffer)) != NULL) {
             name = buffer;
         }
     } else if (type == nw_endpoint_type_hostname) {
@@ -89,11 +91,15 @@ static socket_address proxy_for_endpoint(nw_endpoint_t endpoint) {
     if (name.length() == 0) {
         return proxy;
     }
-    proxy = skia::instance().query_proxy(name, ntohs(port));
+    // the system stack takes a single proxy, so only the first entry applies
+    proxy_list proxies = skia::instance().query_proxy(name, ntohs(port));
+    if (!proxies.direct()) {
+        proxy = proxies.proxies[0];
+    }
     if (proxy.addr == 0) {
-        log("direct connect: %s:%u...applied", name.c_str(), ntohs(port));
+        log("direct connect: %s:%u...applied", name, ntohs(port));
     } else {
-        log("proxied connect: %s:%u...%s:%u...applied", inet_ntoa(*reinterpret_cast<const struct in_addr *>(&proxy.addr)), ntohs(proxy.port), name.c_str(), ntohs(port));
+        log("proxied connect: %s:%u...%s:%u...applied", *reinterpret_cast<const struct in_addr *>(&proxy.addr), ntohs(proxy.port), name, ntohs(port));
     }
     return proxy;
 }
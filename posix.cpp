@@ -1,48 +1,84 @@
 #include "skia.hpp"
 #include <stdexcept>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 #include <netdb.h>
 #include <netdb_async.h>
+#include <poll.h>
+#include <limits.h>
 #include <sys/socket.h>
 #include <sys/fcntl.h>
+#include <sys/event.h>
+#include <netinet/tcp.h>
 #include <FunctionHook.h>
 
 FHOriginalPrototype(int, connect)(int sock, const struct sockaddr *addr, socklen_t addr_len);
+FHOriginalPrototype(int, close)(int fd);
 FHOriginalPrototype(struct hostent *, gethostbyname)(const char *name);
+FHOriginalPrototype(struct hostent *, gethostbyname2)(const char *name, int af);
 FHOriginalPrototype(struct hostent *, gethostbyaddr)(const void *addr, socklen_t len, int type);
+FHOriginalPrototype(struct hostent *, getipnodebyname)(const char *name, int af, int flags, int *error_num);
+FHOriginalPrototype(void, freehostent)(struct hostent *ip);
 FHOriginalPrototype(int, getaddrinfo)(const char *hostname, const char *servname, const struct addrinfo *hints, struct addrinfo **res);
+FHOriginalPrototype(void, freeaddrinfo)(struct addrinfo *ai);
 FHOriginalPrototype(int, getnameinfo)(const struct sockaddr *sa, socklen_t salen, char *host, socklen_t hostlen, char *serv, socklen_t servlen, int flags);
 
-static void try_select(int sock, bool for_write) {
+typedef std::chrono::steady_clock::time_point deadline_t;
+
+static deadline_t deadline_after(uint32_t msec) {
+    return std::chrono::steady_clock::now() + std::chrono::milliseconds(msec);
+}
+
+static uint32_t elapsed_usec(const std::chrono::steady_clock::time_point &start) {
+    return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+}
+
+// Milliseconds for poll until the deadline, rounded up so that poll never
+// returns early and a wait under a millisecond does not spin with 0.
+static int poll_timeout(const std::chrono::steady_clock::time_point &deadline, const std::chrono::steady_clock::time_point &now) {
+    int64_t remaining = std::chrono::duration_cast<std::chrono::microseconds>(deadline - now).count();
+    return remaining > 0 ? static_cast<int>(std::min<int64_t>((remaining + 999) / 1000, INT_MAX)) : 0;
+}
+
+// Waits until the socket is ready or the deadline passes. poll has no limit on
+// descriptor numbers, unlike select with its FD_SETSIZE sized sets, and the
+// remaining time is taken from the deadline again after each interruption.
+static void try_poll(int sock, bool for_write, const deadline_t &deadline) {
     try {
-        fd_set sock_set;
-        struct timeval timeout;
-        timeout.tv_sec = 10;
-        timeout.tv_usec = 0;
+        struct pollfd sock_poll;
+        sock_poll.fd = sock;
+        sock_poll.events = for_write ? POLLOUT : POLLIN;
         while (true) {
-            FD_ZERO(&sock_set);
-            FD_SET(sock, &sock_set);
-            int result = select(sock + 1, for_write ? NULL : &sock_set, for_write ? &sock_set : NULL, NULL, &timeout);
+            sock_poll.revents = 0;
+            int result = poll(&sock_poll, 1, poll_timeout(deadline, std::chrono::steady_clock::now()));
             if (result > 0) {
-                int error;
+                int error = 0;
                 socklen_t error_len = sizeof(error);
                 getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &error_len);
-                if (error == 0) {
-                    return;
-                } else {
+                if (error != 0) {
                     throw std::runtime_error(strerror(error));
+                } else if (sock_poll.revents & POLLNVAL) {
+                    throw std::runtime_error(strerror(EBADF));
+                } else {
+                    return;
                 }
             } else if (result == -1 && errno == EINTR) {
                 continue;
+            } else if (result == -1) {
+                throw std::runtime_error(strerror(errno));
             } else {
                 throw std::runtime_error("timed out");
             }
         }
     } catch (const std::runtime_error &error) {
-        throw std::runtime_error(std::string("select: ") + error.what());
+        throw std::runtime_error(std::string("poll: ") + error.what());
     }
 }
 
-static void timed_connect(int sock, const struct sockaddr *addr, socklen_t addr_len) {
+static void timed_connect(int sock, const struct sockaddr *addr, socklen_t addr_len, const deadline_t &deadline) {
     try {
         class socket_nonblocker {
         private:
@@ -57,7 +93,7 @@ static void timed_connect(int sock, const struct sockaddr *addr, socklen_t addr_
         };
         socket_nonblocker nonblocker(sock);
         if (FHOriginal(connect)(sock, addr, addr_len) == -1 && errno == EINPROGRESS) {
-            try_select(sock, true);
+            try_poll(sock, true, deadline);
             return;
         } else {
             throw std::runtime_error(strerror(errno));
@@ -67,6 +103,15 @@ static void timed_connect(int sock, const struct sockaddr *addr, socklen_t addr_
     }
 }
 
+// The proxy turning a handshake down before replying to it, by refusing every
+// method or by closing the connection cleanly. Only this makes an optimistic
+// handshake fall back to the step by step one. Resets and failed sends may
+// just as well be a broken path, so they fail the proxy as usual.
+class socks_refused: public std::runtime_error {
+public:
+    socks_refused(const std::string &what): std::runtime_error(what) {}
+};
+
 static void send_bytes(int sock, const uint8_t *bytes, size_t len) {
     try {
         ssize_t current = 0;
@@ -75,10 +120,8 @@ static void send_bytes(int sock, const uint8_t *bytes, size_t len) {
             current = send(sock, bytes + total, len - total, 0);
             if (current > 0) {
                 total += current;
-            } else if (current < 0) {
-                throw std::runtime_error(strerror(errno));
             } else {
-                throw std::runtime_error("closed");
+                throw std::runtime_error(current < 0 ? strerror(errno) : "closed");
             }
         }
     } catch (const std::runtime_error &error) {
@@ -86,72 +129,347 @@ static void send_bytes(int sock, const uint8_t *bytes, size_t len) {
     }
 }
 
-static void recv_bytes(int sock, uint8_t *bytes, size_t len) {
+static void recv_bytes(int sock, uint8_t *bytes, size_t len, const deadline_t &deadline) {
     try {
         ssize_t current = 0;
         size_t total = 0;
         while (total < len) {
-            try_select(sock, false);
+            try_poll(sock, false, deadline);
             current = recv(sock, bytes + total, len - total, 0);
             if (current > 0) {
                 total += current;
-            } else if (current < 0) {
-                throw std::runtime_error(strerror(errno));
+            } else if (current == 0) {
+                throw socks_refused("closed");
             } else {
-                throw std::runtime_error("closed");
+                throw std::runtime_error(strerror(errno));
             }
         }
+    } catch (const socks_refused &error) {
+        throw socks_refused(std::string("recv: ") + error.what());
     } catch (const std::runtime_error &error) {
         throw std::runtime_error(std::string("recv: ") + error.what());
     }
 }
 
-static bool make_direct(int &sock, const struct in6_addr &target_addr, const in_port_t &target_port, bool ipv6) {
+// Family that won the last direct connection to each destination, tried first
+// next time. The map is simply dropped when it grows too large.
+static std::mutex family_mutex;
+static std::unordered_map<std::string, int> winning_families;
+
+static int preferred_family(const std::string &target_name) {
+    std::lock_guard<std::mutex> lock(family_mutex);
+    auto entry = winning_families.find(target_name);
+    return entry != winning_families.end() ? entry->second : AF_INET6;
+}
+
+static void remember_family(const std::string &target_name, int family) {
+    std::lock_guard<std::mutex> lock(family_mutex);
+    if (winning_families.size() >= 4096) {
+        winning_families.clear();
+    }
+    winning_families[target_name] = family;
+}
+
+// Connects to the first address that answers, as described in RFC 8305.
+// Addresses alternate between families, starting with the preferred one, and
+// each attempt starts 250 ms after the previous one or as soon as it fails.
+static int race_connect(const std::vector<const struct addrinfo *> &addr_infos, const deadline_t &deadline, int &family, std::string &error_str) {
+    const std::chrono::milliseconds attempt_delay(250);
+    std::chrono::steady_clock::time_point next_attempt = std::chrono::steady_clock::now();
+    std::vector<struct pollfd> attempts;
+    std::vector<int> attempt_families;
+    size_t next = 0;
+    int winner = -1;
+    error_str = "no address";
+    while (winner == -1) {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (next < addr_infos.size() && (now >= next_attempt || attempts.empty())) {
+            const struct addrinfo *addr_info = addr_infos[next++];
+            int sock = socket(addr_info->ai_family, SOCK_STREAM, 0);
+            if (sock == -1) {
+                error_str = strerror(errno);
+                continue;
+            }
+            fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, NULL) | O_NONBLOCK);
+            if (FHOriginal(connect)(sock, addr_info->ai_addr, addr_info->ai_addrlen) == 0) {
+                winner = sock;
+                family = addr_info->ai_family;
+            } else if (errno == EINPROGRESS) {
+                struct pollfd attempt = {sock, POLLOUT, 0};
+                attempts.push_back(attempt);
+                attempt_families.push_back(addr_info->ai_family);
+                next_attempt = now + attempt_delay;
+            } else {
+                error_str = strerror(errno);
+                close(sock);
+            }
+            continue;
+        }
+        if (attempts.empty()) {
+            break;
+        }
+        if (now >= deadline) {
+            error_str = "timed out";
+            break;
+        }
+        std::chrono::steady_clock::time_point wake = next < addr_infos.size() ? std::min(next_attempt, deadline) : deadline;
+        int result = poll(attempts.data(), static_cast<nfds_t>(attempts.size()), poll_timeout(wake, now));
+        if (result == -1 && errno != EINTR) {
+            error_str = strerror(errno);
+            break;
+        }
+        for (size_t i = 0; result > 0 && i < attempts.size();) {
+            if (attempts[i].revents == 0) {
+                i++;
+                continue;
+            }
+            int error = 0;
+            socklen_t error_len = sizeof(error);
+            getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &error, &error_len);
+            if (error == 0 && (attempts[i].revents & POLLOUT)) {
+                winner = attempts[i].fd;
+                family = attempt_families[i];
+            } else {
+                error_str = strerror(error ?: ECONNREFUSED);
+                close(attempts[i].fd);
+                next_attempt = now;
+            }
+            attempts.erase(attempts.begin() + i);
+            attempt_families.erase(attempt_families.begin() + i);
+            if (winner != -1) {
+                break;
+            }
+        }
+    }
+    for (const struct pollfd &attempt : attempts) {
+        close(attempt.fd);
+    }
+    if (winner != -1) {
+        fcntl(winner, F_SETFL, fcntl(winner, F_GETFL, NULL) & ~O_NONBLOCK);
+    }
+    return winner;
+}
+
+static bool make_direct(int &sock, const connect_target &target) {
     bool result = false;
     std::string target_name;
-    std::string target_serv = std::to_string(ntohs(target_port));
+    std::string target_serv = std::to_string(ntohs(target.port));
     struct addrinfo *addr_info_list, hints;
+    memset(&hints, 0, sizeof(hints));
     hints.ai_flags = AI_ADDRCONFIG | AI_NUMERICSERV;
     hints.ai_socktype = SOCK_STREAM;
-    hints.ai_protocol = IPPROTO_IP;
+    hints.ai_protocol = IPPROTO_TCP;
     hints.ai_family = AF_UNSPEC;
-    if (!ipv6 && resolve_table::instance().is_resolved_addr(target_addr.__u6_addr.__u6_addr32[0])) {
-        target_name = resolve_table::instance().addr_to_name(reinterpret_cast<const in_addr *>(&target_addr)->s_addr);
+    if (target.resolved) {
+        target_name = target.name.str();
     } else {
         char target_name_buffer[INET6_ADDRSTRLEN];
-        target_name = inet_ntop(ipv6 ? AF_INET6 : AF_INET, &target_addr, target_name_buffer, sizeof(target_name_buffer));
+        target_name = inet_ntop(target.ipv6 ? AF_INET6 : AF_INET, &target.addr, target_name_buffer, sizeof(target_name_buffer));
         hints.ai_flags |= AI_NUMERICHOST;
-        hints.ai_family = ipv6 ? AF_INET6 : AF_INET;
+        hints.ai_family = target.ipv6 ? AF_INET6 : AF_INET;
     }
-    std::string log_str = target_name + ":" + target_serv + "...";
-    if (FHOriginal(getaddrinfo)(target_name.c_str(), target_serv.c_str(), NULL, &addr_info_list) == 0) {
+    if (FHOriginal(getaddrinfo)(target_name.c_str(), target_serv.c_str(), &hints, &addr_info_list) == 0) {
+        int first_family = preferred_family(target_name);
+        std::vector<const struct addrinfo *> first, second, addr_infos;
         for (struct addrinfo *addr_info = addr_info_list; addr_info != NULL; addr_info = addr_info->ai_next) {
-            sock = socket(addr_info->ai_family, hints.ai_socktype, 0);
-            if (sock == -1) {
-                err("direct connect failed: %s%s", log_str.c_str(), strerror(errno));
-                continue;
+            if (addr_info->ai_family == AF_INET || addr_info->ai_family == AF_INET6) {
+                (addr_info->ai_family == first_family ? first : second).push_back(addr_info);
             }
-            try {
-                timed_connect(sock, addr_info->ai_addr, addr_info->ai_addrlen);
-                result = true;
-                log("direct connect: %s%s", log_str.c_str(), "ok");
-                break;
-            } catch (const std::runtime_error &error) {
-                close(sock);
-                err("direct connect failed: %s%s", log_str.c_str(), error.what());
-                continue;
+        }
+        for (size_t i = 0; i < first.size() || i < second.size(); i++) {
+            if (i < first.size()) {
+                addr_infos.push_back(first[i]);
+            }
+            if (i < second.size()) {
+                addr_infos.push_back(second[i]);
+            }
+        }
+        // DIRECT has a connect timeout of its own, adapted like those of the
+        // proxies, and the address lookup above is not part of it
+        const proxy_address direct;
+        int family = AF_UNSPEC;
+        std::string error_str;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        deadline_t deadline = deadline_after(skia::instance().proxy_timeout(direct, phase_connect));
+        sock = race_connect(addr_infos, deadline, family, error_str);
+        if (sock != -1) {
+            result = true;
+            uint32_t connect_usec = elapsed_usec(start);
+            remember_family(target_name, family);
+            skia::instance().proxy_observed(direct, phase_connect, connect_usec);
+            skia::instance().connection_stats().sample(stats_table::direct_connect_usec, connect_usec);
+            log("direct connect: %s:%s...%s", target_name, target_serv, "ok");
+        } else {
+            if (std::chrono::steady_clock::now() >= deadline) {
+                skia::instance().proxy_expired(direct, phase_connect);
             }
+            err("direct connect failed: %s:%s...%s", target_name, target_serv, error_str);
         }
         freeaddrinfo(addr_info_list);
     } else {
-        err("direct connect failed: %s%s", log_str.c_str(), strerror(errno));
+        err("direct connect failed: %s:%s...%s", target_name, target_serv, strerror(errno));
     }
+    skia::instance().connection_stats().count(result ? stats_table::connects_direct : stats_table::failures_direct);
     return result;
 }
 
-static bool make_proxied(int &sock, const struct in6_addr &target_addr, const in_port_t &target_port, bool ipv6, const socket_address &proxy) {
+static size_t socks_greeting(uint8_t *buffer) {
+    buffer[0] = 5; // version
+    buffer[1] = 1; // number of methods
+    buffer[2] = 0; // method #1: no authentication required
+    return 3;
+}
+
+static void socks_greeting_reply(const uint8_t *buffer) {
+    if (buffer[0] != 5) {
+        throw std::runtime_error("invalid proxy");
+    }
+    if (buffer[1] == 0xff) {
+        throw socks_refused("no acceptable methods");
+    }
+    if (buffer[1] != 0) {
+        throw std::runtime_error("proxy authentication required");
+    }
+}
+
+static size_t socks_request(uint8_t *buffer, const connect_target &target) {
+    size_t len = 0;
+    buffer[len++] = 5; // version
+    buffer[len++] = 1; // command: connect
+    buffer[len++] = 0; // reserved
+    if (target.resolved) {
+        buffer[len++] = 3; // address type = name
+        buffer[len] = std::min(target.name.length(), static_cast<size_t>(UINT8_MAX));
+        memcpy(buffer + len + 1, target.name.c_str(), buffer[len]);
+        len += buffer[len] + 1;
+    } else if (target.ipv6) {
+        buffer[len++] = 4; // address type = ipv6
+        memcpy(buffer + len, &target.addr, sizeof(struct in6_addr));
+        len += sizeof(struct in6_addr);
+    } else {
+        buffer[len++] = 1; // address type = ipv4
+        memcpy(buffer + len, &target.addr, sizeof(struct in_addr));
+        len += sizeof(struct in_addr);
+    }
+    memcpy(buffer + len, &target.port, sizeof(in_port_t));
+    len += sizeof(in_port_t);
+    return len;
+}
+
+// Failure code in the reply to a connect request, told apart for the metrics.
+class socks_error: public std::runtime_error {
+public:
+    const uint8_t code;
+    socks_error(const std::string &what, uint8_t code): std::runtime_error(what), code(code) {}
+};
+
+static size_t socks_reply(const uint8_t *buffer) {
+    if (buffer[0] != 5) {
+        throw std::runtime_error("invalid proxy");
+    }
+    switch (buffer[1]) {
+        case 0: break;
+        case 1: throw socks_error("general failure", buffer[1]);
+        case 2: throw socks_error("connection not allowed", buffer[1]);
+        case 3: throw socks_error("network unreachable", buffer[1]);
+        case 4: throw socks_error("host unreachable", buffer[1]);
+        case 5: throw socks_error("connection refused", buffer[1]);
+        case 6: throw socks_error("ttl expired", buffer[1]);
+        case 7: throw socks_error("command not supported", buffer[1]);
+        case 8: throw socks_error("address type not supported", buffer[1]);
+        default: throw socks_error("unknown error " + std::to_string(buffer[1]), buffer[1]);
+    }
+    switch (buffer[3]) {
+        case 1: return sizeof(struct in_addr) + sizeof(in_port_t);
+        case 3: return 0; // length of name follows
+        case 4: return sizeof(struct in6_addr) + sizeof(in_port_t);
+        default: throw std::runtime_error("replied address type not supported");
+    }
+}
+
+// Address of the proxy for a socket of the family, ipv4 mapped for ipv6 ones.
+static socklen_t proxy_sockaddr(int family, const socket_address &proxy, struct sockaddr_storage &storage) {
+    memset(&storage, 0, sizeof(storage));
+    if (family == AF_INET6) {
+        struct sockaddr_in6 *addr = reinterpret_cast<struct sockaddr_in6 *>(&storage);
+        addr->sin6_len = sizeof(struct sockaddr_in6);
+        addr->sin6_family = AF_INET6;
+        addr->sin6_port = proxy.port;
+        addr->sin6_addr.__u6_addr.__u6_addr16[5] = 0xffff;
+        addr->sin6_addr.__u6_addr.__u6_addr32[3] = proxy.addr;
+        return sizeof(struct sockaddr_in6);
+    }
+    struct sockaddr_in *addr = reinterpret_cast<struct sockaddr_in *>(&storage);
+    addr->sin_len = sizeof(struct sockaddr_in);
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = proxy.addr;
+    addr->sin_port = proxy.port;
+    return sizeof(struct sockaddr_in);
+}
+
+// Log arguments, kept binary until the record is emitted.
+static const struct in_addr &proxy_host(const socket_address &proxy) {
+    return *reinterpret_cast<const struct in_addr *>(&proxy.addr);
+}
+
+// Proxies that refused an optimistic handshake are spoken to step by step
+// until the refusal expires, so a proxy that was restarted or replaced on the
+// same port gets another chance.
+static const int optimistic_retry_sec = 600;
+static std::mutex optimistic_mutex;
+static std::unordered_map<uint64_t, std::chrono::steady_clock::time_point> optimistic_rejected;
+
+static bool socks_optimistic(const proxy_address &proxy) {
+    if (!proxy.optimistic) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(optimistic_mutex);
+    auto entry = optimistic_rejected.find(static_cast<uint64_t>(proxy.addr) << 16 | proxy.port);
+    if (entry == optimistic_rejected.end()) {
+        return true;
+    }
+    if (entry->second <= std::chrono::steady_clock::now()) {
+        optimistic_rejected.erase(entry);
+        return true;
+    }
+    return false;
+}
+
+static void socks_reject_optimistic(const proxy_address &proxy) {
+    std::lock_guard<std::mutex> lock(optimistic_mutex);
+    optimistic_rejected[static_cast<uint64_t>(proxy.addr) << 16 | proxy.port] = std::chrono::steady_clock::now() + std::chrono::seconds(optimistic_retry_sec);
+}
+
+static void record_proxied(const proxy_address &proxy, uint32_t connect_usec, uint32_t handshake_usec) {
+    metrics &stats = skia::instance().connection_stats();
+    stats.count(stats_table::connects_proxied);
+    stats.sample(stats_table::proxy_connect_usec, connect_usec);
+    stats.sample(stats_table::proxy_handshake_usec, handshake_usec);
+    stats.proxy_count(proxy, stats_table::proxy_connects);
+    stats.proxy_sample(proxy, stats_table::proxy_histogram_connect_usec, connect_usec);
+    stats.proxy_sample(proxy, stats_table::proxy_histogram_handshake_usec, handshake_usec);
+}
+
+static void record_proxied_failure(const proxy_address &proxy, proxy_phase phase, const std::runtime_error &error) {
+    metrics &stats = skia::instance().connection_stats();
+    stats.count(stats_table::failures_proxied);
+    const socks_error *reply_error = dynamic_cast<const socks_error *>(&error);
+    if (reply_error != NULL) {
+        stats.proxy_count(proxy, stats_table::proxy_failures_code + std::min<int>(reply_error->code, 9) - 1);
+    } else if (phase == phase_connect) {
+        stats.proxy_count(proxy, stats_table::proxy_failures_connect);
+    } else if (phase == phase_greeting) {
+        stats.proxy_count(proxy, stats_table::proxy_failures_greeting);
+    } else {
+        stats.proxy_count(proxy, stats_table::proxy_failures_reply);
+    }
+}
+
+static bool make_proxied(int &sock, const connect_target &target, const proxy_address &proxy) {
+    proxy_phase phase = phase_count; // phase_count until the proxy is contacted
+    deadline_t deadline;
     try {
-        if (resolve_table::instance().is_resolved_addr(target_addr.__u6_addr.__u6_addr32[0]) && resolve_table::instance().addr_to_name(reinterpret_cast<const in_addr *>(&target_addr)->s_addr).length() == 0) {
+        if (target.resolved && target.name.empty()) {
             throw std::runtime_error("invalid resolved address");
         }
 
@@ -160,119 +478,557 @@ static bool make_proxied(int &sock, const struct in6_addr &target_addr, const in
             throw std::runtime_error(strerror(errno));
         }
 
+        skia &instance = skia::instance();
+        phase = phase_connect;
         struct sockaddr_in proxy_addr;
         memset(&proxy_addr, 0, sizeof(proxy_addr));
         proxy_addr.sin_len = sizeof(proxy_addr);
         proxy_addr.sin_family = AF_INET;
         proxy_addr.sin_addr.s_addr = proxy.addr;
         proxy_addr.sin_port = proxy.port;
-        timed_connect(sock, reinterpret_cast<struct sockaddr *>(&proxy_addr), sizeof(proxy_addr));
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        deadline = deadline_after(instance.proxy_timeout(proxy, phase_connect));
+        timed_connect(sock, reinterpret_cast<struct sockaddr *>(&proxy_addr), sizeof(proxy_addr), deadline);
+        uint32_t connect_usec = elapsed_usec(start);
+        instance.proxy_observed(proxy, phase_connect, connect_usec);
 
+        phase = phase_greeting;
         uint8_t buffer[1024];
-        // SOCK 5 negotiation
-        buffer[0] = 5; // version
-        buffer[1] = 1; // number of methods
-        buffer[2] = 0; // method #1: no authentication required
-        send_bytes(sock, buffer, 3);
-        recv_bytes(sock, buffer, 2);
-        if (buffer[0] != 5) {
-            throw std::runtime_error("invalid proxy");
-        }
-        if (buffer[1] != 0) {
-            throw std::runtime_error("proxy authentication required");
-        }
-        // SOCK5 request
-        buffer[0] = 5; // version
-        buffer[1] = 1; // command: connect
-        buffer[2] = 0; // reserved
-        std::string target_str;
-        if (ipv6) {
-            buffer[3] = 4; // address type = ipv6
-            send_bytes(sock, buffer, 4);
-            send_bytes(sock, reinterpret_cast<const uint8_t *>(&target_addr), sizeof(struct in6_addr));
-            send_bytes(sock, reinterpret_cast<const uint8_t *>(&target_port), sizeof(in_port_t));
-            target_str = inet_ntop(AF_INET6, &target_addr, reinterpret_cast<char *>(buffer), sizeof(buffer)) + std::string(":") + std::to_string(ntohs(target_port));
-        } else if (resolve_table::instance().is_resolved_addr(target_addr.__u6_addr.__u6_addr32[0])) {
-            buffer[3] = 3; // address type = name
-            send_bytes(sock, buffer, 4);
-            std::string target_name = resolve_table::instance().addr_to_name(reinterpret_cast<const in_addr *>(&target_addr)->s_addr);
-            buffer[0] = std::min(target_name.length(), static_cast<size_t>(UINT8_MAX));
-            send_bytes(sock, buffer, 1);
-            send_bytes(sock, reinterpret_cast<const uint8_t *>(target_name.c_str()), buffer[0]);
-            send_bytes(sock, reinterpret_cast<const uint8_t *>(&target_port), sizeof(in_port_t));
-            target_str = target_name + ":" + std::to_string(ntohs(target_port));
+        size_t greeting_len = socks_greeting(buffer);
+        size_t request_len = socks_request(buffer + greeting_len, target);
+        start = std::chrono::steady_clock::now();
+        std::chrono::steady_clock::time_point handshake_start = start;
+        deadline = deadline_after(instance.proxy_timeout(proxy, phase_greeting));
+        bool optimistic = socks_optimistic(proxy);
+        if (optimistic) {
+            // SOCK5 negotiation and request in a single segment
+            try {
+                send_bytes(sock, buffer, greeting_len + request_len);
+                recv_bytes(sock, buffer, 2, deadline);
+                socks_greeting_reply(buffer);
+            } catch (const socks_refused &error) {
+                log("optimistic handshake rejected: %s:%u...%s:%u...%s", proxy_host(proxy), ntohs(proxy.port), target.host(), ntohs(target.port), error.what());
+                socks_reject_optimistic(proxy);
+                close(sock);
+                return make_proxied(sock, target, proxy);
+            }
+            instance.proxy_observed(proxy, phase_greeting, elapsed_usec(start));
+            start = std::chrono::steady_clock::now();
         } else {
-            buffer[3] = 1; // address type = ipv4
-            send_bytes(sock, buffer, 4);
-            send_bytes(sock, reinterpret_cast<const uint8_t *>(&target_addr), sizeof(struct in_addr));
-            send_bytes(sock, reinterpret_cast<const uint8_t *>(&target_port), sizeof(in_port_t));
-            target_str = inet_ntop(AF_INET, &target_addr, reinterpret_cast<char *>(buffer), sizeof(buffer)) + std::string(":") + std::to_string(ntohs(target_port));
-        }
-        recv_bytes(sock, buffer, 4);
-        std::string log_str = std::string(inet_ntoa(*reinterpret_cast<const struct in_addr *>(&proxy.addr))) + ":" + std::to_string(ntohs(proxy.port)) + "..." + target_str + "...";
-        if (buffer[0] != 5) {
-            throw std::runtime_error(log_str + "invalid proxy");
-        }
-        switch (buffer[1]) {
-            case 0: break;
-            case 1: throw std::runtime_error(log_str + "general failure");
-            case 2: throw std::runtime_error(log_str + "connection not allowed");
-            case 3: throw std::runtime_error(log_str + "network unreachable");
-            case 4: throw std::runtime_error(log_str + "host unreachable");
-            case 5: throw std::runtime_error(log_str + "connection refused");
-            case 6: throw std::runtime_error(log_str + "ttl expired");
-            case 7: throw std::runtime_error(log_str + "command not supported");
-            case 8: throw std::runtime_error(log_str + "address type not supported");
-            default: throw std::runtime_error(log_str + "unknown error " + std::to_string(buffer[1]));
-        }
-        size_t remaining_len = 0;
-        switch (buffer[3]) {
-            case 1:
-                remaining_len = sizeof(struct in_addr) + sizeof(in_port_t);
-                break;
-            case 3:
-                recv_bytes(sock, buffer, 1);
-                remaining_len = buffer[0] + sizeof(in_port_t);
-                break;
-            case 4:
-                remaining_len = sizeof(struct in6_addr) + sizeof(in_port_t);
-                break;
-            default:
-                throw std::runtime_error(log_str + "replied address type not supported");
+            // SOCK 5 negotiation
+            send_bytes(sock, buffer, greeting_len);
+            recv_bytes(sock, buffer, 2, deadline);
+            socks_greeting_reply(buffer);
+            instance.proxy_observed(proxy, phase_greeting, elapsed_usec(start));
+            start = std::chrono::steady_clock::now();
         }
-        recv_bytes(sock, buffer, remaining_len);
-        log("proxied connect: %s%s", log_str.c_str(), "ok");
+        // the request belongs to the reply phase, as in the reactor
+        phase = phase_reply;
+        deadline = deadline_after(instance.proxy_timeout(proxy, phase_reply));
+        if (!optimistic) {
+            // SOCK5 request
+            send_bytes(sock, buffer + greeting_len, request_len);
+        }
+        recv_bytes(sock, buffer, 4, deadline);
+        size_t remaining_len = socks_reply(buffer);
+        if (remaining_len == 0) {
+            recv_bytes(sock, buffer, 1, deadline);
+            remaining_len = buffer[0] + sizeof(in_port_t);
+        }
+        recv_bytes(sock, buffer, remaining_len, deadline);
+        instance.proxy_observed(proxy, phase_reply, elapsed_usec(start));
+        instance.proxy_succeeded(proxy);
+        record_proxied(proxy, connect_usec, elapsed_usec(handshake_start));
+        log("proxied connect: %s:%u...%s:%u...%s", proxy_host(proxy), ntohs(proxy.port), target.host(), ntohs(target.port), "ok");
         return true;
     } catch (const std::runtime_error &error) {
         close(sock);
-        err("proxied connect failed: %s", error.what());
+        if (phase != phase_count && std::chrono::steady_clock::now() >= deadline) {
+            skia::instance().proxy_expired(proxy, phase);
+        }
+        if (phase == phase_connect || phase == phase_greeting) {
+            // errors up to the greeting reply count against the proxy
+            skia::instance().proxy_failed(proxy);
+        }
+        if (phase != phase_count) {
+            record_proxied_failure(proxy, phase, error);
+        }
+        err("proxied connect failed: %s:%u...%s:%u...%s", proxy_host(proxy), ntohs(proxy.port), target.host(), ntohs(target.port), error.what());
         return false;
     }
 }
 
+// Settings the application may have made on its socket before connecting,
+// carried over to the socket that replaces it.
+static void inherit_options(int from, int to) {
+    static const int options[][2] = {
+        {SOL_SOCKET, SO_NOSIGPIPE},
+        {SOL_SOCKET, SO_KEEPALIVE},
+        {IPPROTO_TCP, TCP_NODELAY},
+    };
+    for (const auto &option : options) {
+        int value = 0;
+        socklen_t value_len = sizeof(value);
+        if (getsockopt(from, option[0], option[1], &value, &value_len) == 0 && value != 0) {
+            setsockopt(to, option[0], option[1], &value, value_len);
+        }
+    }
+}
+
+// Drives the SOCKS5 handshake of non-blocking sockets on a kqueue thread. The
+// handshake runs on sockets of its own, and the application socket is left
+// unconnected, so it reports neither readable nor writable, until the reply
+// arrives and the tunnel gets moved onto it with dup2. The application thus
+// never sees the handshake, and its reads and writes go straight to the
+// system. The proxies of the list are tried in order, and with racing enabled
+// the next one starts after a short delay instead of waiting for the current
+// one to fail. The slot of a fake target address stays pinned for as long as
+// the connection is pending here.
+class socks_reactor {
+private:
+    enum class phase {
+        connect,
+        greeting_send,
+        greeting_recv,
+        request_send,
+        reply_recv,
+        reply_name_recv,
+        reply_addr_recv,
+    };
+    struct connection {
+        int app_sock;
+        int sock;
+        uintptr_t token; // tells events of this socket from ones of an earlier socket with the same descriptor
+        proxy_address proxy;
+        bool optimistic;
+        phase state = phase::connect;
+        uint8_t buffer[512];
+        size_t offset = 0, length = 0;
+        uint8_t request[512];
+        size_t request_len = 0;
+        log_host target; // points into the name held by the pending connect
+        in_port_t target_port;
+        std::chrono::steady_clock::time_point phase_start, handshake_start;
+        uint32_t connect_usec = 0;
+    };
+    struct pending {
+        proxy_list proxies;
+        size_t next = 0; // next entry of the list to start
+        connect_target target;
+        in_addr_t pinned = 0; // fake target address pinned by this connect
+        std::vector<int> socks; // handshakes in flight
+        bool direct = false; // direct connection in flight on its own thread
+        uintptr_t token = 0; // tells a pending connect from a later one on the same descriptor
+    };
+    static std::atomic<size_t> pending_count;
+    static const intptr_t stagger_msec = 250;
+    int queue;
+    uintptr_t last_token = 0;
+    std::unordered_map<int, connection> connections;
+    std::unordered_map<int, pending> app_socks;
+    std::mutex mutex;
+    socks_reactor() {
+        queue = kqueue();
+        std::thread(&socks_reactor::run, this).detach();
+    }
+    ~socks_reactor() {}
+    void watch(const connection &c, int16_t filter) {
+        struct kevent event;
+        EV_SET(&event, c.sock, filter, EV_ADD | EV_ONESHOT, 0, 0, reinterpret_cast<void *>(c.token));
+        kevent(queue, &event, 1, NULL, 0, NULL);
+    }
+    // Starts the time limit of the next phase, replacing the previous one.
+    void arm(connection &c, proxy_phase phase) {
+        struct kevent event;
+        EV_SET(&event, c.sock, EVFILT_TIMER, EV_ADD | EV_ONESHOT, 0, skia::instance().proxy_timeout(c.proxy, phase), reinterpret_cast<void *>(c.token));
+        kevent(queue, &event, 1, NULL, 0, NULL);
+        c.phase_start = std::chrono::steady_clock::now();
+    }
+    void unwatch(int sock) {
+        struct kevent events[3];
+        EV_SET(&events[0], sock, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
+        EV_SET(&events[1], sock, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+        EV_SET(&events[2], sock, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+        for (struct kevent &event : events) {
+            kevent(queue, &event, 1, NULL, 0, NULL);
+        }
+    }
+    bool open(connection &c) {
+        c.sock = socket(PF_INET, SOCK_STREAM, 0);
+        if (c.sock == -1) {
+            err("proxied connect failed: %s:%u...%s:%u...%s", proxy_host(c.proxy), ntohs(c.proxy.port), c.target, ntohs(c.target_port), strerror(errno));
+            return false;
+        }
+        fcntl(c.sock, F_SETFL, fcntl(c.sock, F_GETFL, NULL) | O_NONBLOCK);
+        inherit_options(c.app_sock, c.sock);
+        struct sockaddr_storage proxy_addr;
+        socklen_t proxy_addr_len = proxy_sockaddr(AF_INET, c.proxy, proxy_addr);
+        if (FHOriginal(connect)(c.sock, reinterpret_cast<struct sockaddr *>(&proxy_addr), proxy_addr_len) == -1 && errno != EINPROGRESS) {
+            int error = errno;
+            err("proxied connect failed: %s:%u...%s:%u...connect: %s", proxy_host(c.proxy), ntohs(c.proxy.port), c.target, ntohs(c.target_port), strerror(error));
+            skia::instance().proxy_failed(c.proxy);
+            record_proxied_failure(c.proxy, phase_connect, std::runtime_error(strerror(error)));
+            FHOriginal(close)(c.sock);
+            c.sock = -1;
+            return false;
+        }
+        c.token = ++last_token;
+        c.state = phase::connect;
+        c.optimistic = socks_optimistic(c.proxy);
+        arm(c, phase_connect);
+        watch(c, EVFILT_WRITE);
+        app_socks[c.app_sock].socks.push_back(c.sock);
+        connections[c.sock] = c;
+        return true;
+    }
+    // Starts the next entry of the list. A direct entry waits until no proxy is
+    // in flight. Returns false once nothing is left to wait for.
+    bool advance(int app_sock, pending &p) {
+        while (p.next < p.proxies.count) {
+            const proxy_address &proxy = p.proxies.proxies[p.next];
+            if (proxy.addr == 0) {
+                if (p.socks.empty()) {
+                    p.next++;
+                    start_direct(app_sock, p);
+                }
+                return true;
+            }
+            p.next++;
+            connection c;
+            c.app_sock = app_sock;
+            c.proxy = proxy;
+            c.request_len = socks_request(c.request, p.target);
+            c.target = p.target.host();
+            c.target_port = p.target.port;
+            if (!open(c)) {
+                continue;
+            }
+            if (p.proxies.race && p.next < p.proxies.count && p.proxies.proxies[p.next].addr != 0) {
+                struct kevent event;
+                EV_SET(&event, app_sock, EVFILT_TIMER, EV_ADD | EV_ONESHOT, 0, stagger_msec, reinterpret_cast<void *>(p.token));
+                kevent(queue, &event, 1, NULL, 0, NULL);
+            }
+            return true;
+        }
+        return !p.socks.empty() || p.direct;
+    }
+    // Every proxy failed and the list falls back to a direct connection, which
+    // has no non-blocking implementation, so it runs on its own thread.
+    void start_direct(int app_sock, pending &p) {
+        p.direct = true;
+        uintptr_t token = p.token;
+        connect_target target = p.target;
+        std::thread([this, app_sock, token, target]() {
+            int sock = -1;
+            if (!make_direct(sock, target)) {
+                sock = -1;
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            auto entry = app_socks.find(app_sock);
+            if (entry == app_socks.end() || entry->second.token != token) {
+                if (sock != -1) {
+                    FHOriginal(close)(sock);
+                }
+                return;
+            }
+            if (sock != -1) {
+                fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, NULL) | O_NONBLOCK);
+                inherit_options(app_sock, sock);
+            }
+            finish(app_sock, sock);
+        }).detach();
+    }
+    void drop(const connection &c) {
+        int sock = c.sock;
+        unwatch(sock);
+        FHOriginal(close)(sock);
+        std::vector<int> &socks = app_socks[c.app_sock].socks;
+        socks.erase(std::remove(socks.begin(), socks.end(), sock), socks.end());
+        connections.erase(sock);
+    }
+    void run() {
+        struct kevent events[16];
+        while (true) {
+            int count = kevent(queue, NULL, 0, events, sizeof(events) / sizeof(events[0]), NULL);
+            if (count == -1) {
+                if (errno != EINTR) {
+                    err("kevent: %s", strerror(errno));
+                }
+                continue;
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            for (int i = 0; i < count; i++) {
+                int ident = static_cast<int>(events[i].ident);
+                uintptr_t token = reinterpret_cast<uintptr_t>(events[i].udata);
+                bool timer = events[i].filter == EVFILT_TIMER;
+                auto entry = connections.find(ident);
+                if (entry == connections.end() || entry->second.token != token) {
+                    // the racing delay is armed on the application socket
+                    auto waiting = app_socks.find(ident);
+                    if (timer && waiting != app_socks.end() && waiting->second.token == token) {
+                        advance(ident, waiting->second);
+                    }
+                    continue;
+                }
+                connection &c = entry->second;
+                int app_sock = c.app_sock;
+                try {
+                    if (timer) {
+                        throw std::runtime_error("timed out");
+                    }
+                    if (process(c, events[i])) {
+                        log("proxied connect: %s:%u...%s:%u...%s", proxy_host(c.proxy), ntohs(c.proxy.port), c.target, ntohs(c.target_port), "ok");
+                        skia::instance().proxy_succeeded(c.proxy);
+                        record_proxied(c.proxy, c.connect_usec, elapsed_usec(c.handshake_start));
+                        finish(app_sock, c.sock);
+                    }
+                } catch (const std::runtime_error &error) {
+                    proxy_phase failed_phase = c.state == phase::connect ? phase_connect : c.state < phase::request_send ? phase_greeting : phase_reply;
+                    if (timer) {
+                        skia::instance().proxy_expired(c.proxy, failed_phase);
+                    }
+                    if (c.optimistic && failed_phase == phase_greeting && dynamic_cast<const socks_refused *>(&error) != NULL) {
+                        // starts over step by step on a new connection to the same proxy
+                        log("optimistic handshake rejected: %s:%u...%s:%u...%s", proxy_host(c.proxy), ntohs(c.proxy.port), c.target, ntohs(c.target_port), error.what());
+                        socks_reject_optimistic(c.proxy);
+                        connection retry = c;
+                        drop(c);
+                        retry.offset = retry.length = 0;
+                        if (!open(retry) && !advance(app_sock, app_socks[app_sock])) {
+                            finish(app_sock, -1);
+                        }
+                        continue;
+                    }
+                    err("proxied connect failed: %s:%u...%s:%u...%s", proxy_host(c.proxy), ntohs(c.proxy.port), c.target, ntohs(c.target_port), error.what());
+                    if (failed_phase != phase_reply) {
+                        // a failing or slow reply is down to the target, not the proxy
+                        skia::instance().proxy_failed(c.proxy);
+                    }
+                    record_proxied_failure(c.proxy, failed_phase, error);
+                    drop(c);
+                    if (!advance(app_sock, app_socks[app_sock])) {
+                        finish(app_sock, -1);
+                    }
+                }
+            }
+        }
+    }
+    bool process(connection &c, const struct kevent &event) {
+        if (c.state == phase::connect) {
+            int error = 0;
+            socklen_t error_len = sizeof(error);
+            if (event.flags & EV_EOF) {
+                error = static_cast<int>(event.fflags);
+            } else {
+                getsockopt(c.sock, SOL_SOCKET, SO_ERROR, &error, &error_len);
+            }
+            if (error != 0) {
+                throw std::runtime_error(std::string("connect: ") + strerror(error));
+            }
+            c.connect_usec = elapsed_usec(c.phase_start);
+            skia::instance().proxy_observed(c.proxy, phase_connect, c.connect_usec);
+            arm(c, phase_greeting);
+            c.handshake_start = c.phase_start;
+            c.state = phase::greeting_send;
+            c.offset = 0;
+            c.length = socks_greeting(c.buffer);
+            if (c.optimistic) {
+                memcpy(c.buffer + c.length, c.request, c.request_len);
+                c.length += c.request_len;
+            }
+        }
+        while (true) {
+            bool sending = c.state == phase::greeting_send || c.state == phase::request_send;
+            while (c.offset < c.length) {
+                ssize_t current = sending ? send(c.sock, c.buffer + c.offset, c.length - c.offset, 0) : recv(c.sock, c.buffer + c.offset, c.length - c.offset, 0);
+                if (current > 0) {
+                    c.offset += current;
+                } else if (current < 0 && (errno == EAGAIN || errno == EINTR)) {
+                    watch(c, sending ? EVFILT_WRITE : EVFILT_READ);
+                    return false;
+                } else if (current == 0 && c.state == phase::greeting_recv) {
+                    throw socks_refused("recv: closed");
+                } else if (current == 0) {
+                    throw std::runtime_error(sending ? "send: closed" : "recv: closed");
+                } else {
+                    throw std::runtime_error(std::string(sending ? "send: " : "recv: ") + strerror(errno));
+                }
+            }
+            c.offset = 0;
+            switch (c.state) {
+                case phase::greeting_send:
+                    c.state = phase::greeting_recv;
+                    c.length = 2;
+                    break;
+                case phase::greeting_recv:
+                    socks_greeting_reply(c.buffer);
+                    skia::instance().proxy_observed(c.proxy, phase_greeting, elapsed_usec(c.phase_start));
+                    arm(c, phase_reply);
+                    if (c.optimistic) {
+                        c.state = phase::reply_recv;
+                        c.length = 4;
+                    } else {
+                        c.state = phase::request_send;
+                        c.length = c.request_len;
+                        memcpy(c.buffer, c.request, c.request_len);
+                    }
+                    break;
+                case phase::request_send:
+                    c.state = phase::reply_recv;
+                    c.length = 4;
+                    break;
+                case phase::reply_recv:
+                    c.length = socks_reply(c.buffer);
+                    c.state = c.length == 0 ? phase::reply_name_recv : phase::reply_addr_recv;
+                    c.length = c.length ?: 1;
+                    break;
+                case phase::reply_name_recv:
+                    c.state = phase::reply_addr_recv;
+                    c.length = c.buffer[0] + sizeof(in_port_t);
+                    break;
+                default:
+                    skia::instance().proxy_observed(c.proxy, phase_reply, elapsed_usec(c.phase_start));
+                    return true;
+            }
+        }
+    }
+    // Closes every socket of a pending connect and forgets it, along with the
+    // pin of its target.
+    void release(std::unordered_map<int, pending>::iterator entry, int kept_sock) {
+        for (int sock : entry->second.socks) {
+            unwatch(sock);
+            if (sock != kept_sock) {
+                FHOriginal(close)(sock);
+            }
+            connections.erase(sock);
+        }
+        unwatch(entry->first);
+        if (entry->second.pinned != 0) {
+            resolve_table::instance().unpin(entry->second.pinned);
+        }
+        app_socks.erase(entry);
+        pending_count--;
+    }
+    // Moves the tunnel onto the application socket and abandons the rest of the
+    // list. Without a tunnel, the application gets a socket that reads EOF and
+    // fails to write.
+    void finish(int app_sock, int sock) {
+        release(app_socks.find(app_sock), sock);
+        if (sock == -1) {
+            int pair[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0) {
+                int no_sigpipe = 1;
+                setsockopt(pair[0], SOL_SOCKET, SO_NOSIGPIPE, &no_sigpipe, sizeof(no_sigpipe));
+                fcntl(pair[0], F_SETFL, fcntl(pair[0], F_GETFL, NULL) | O_NONBLOCK);
+                FHOriginal(close)(pair[1]);
+                sock = pair[0];
+            }
+        }
+        if (sock != -1) {
+            dup2(sock, app_sock);
+            FHOriginal(close)(sock);
+        }
+    }
+public:
+    static socks_reactor &instance() {
+        static socks_reactor instance;
+        return instance;
+    }
+    // Starts connecting through the list and leaves the rest to the reactor
+    // thread. Returns false when nothing could be started.
+    bool start(int app_sock, const connect_target &target, const proxy_list &proxies) {
+        if (target.resolved && target.name.empty()) {
+            err("proxied connect failed: %s", "invalid resolved address");
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        pending &p = app_socks[app_sock];
+        p.proxies = proxies;
+        p.target = target;
+        p.token = ++last_token;
+        pending_count++;
+        in_addr_t addr = target.addr.__u6_addr.__u6_addr32[target.ipv6 ? 3 : 0];
+        if (resolve_table::instance().pin(addr, target.name)) {
+            p.pinned = addr;
+        }
+        if (!advance(app_sock, p)) {
+            release(app_socks.find(app_sock), -1);
+            return false;
+        }
+        return true;
+    }
+    static bool is_pending(int app_sock) {
+        if (pending_count == 0) {
+            return false;
+        }
+        socks_reactor &reactor = instance();
+        std::lock_guard<std::mutex> lock(reactor.mutex);
+        return reactor.app_socks.find(app_sock) != reactor.app_socks.end();
+    }
+    static void cancel(int app_sock) {
+        if (pending_count == 0) {
+            return;
+        }
+        socks_reactor &reactor = instance();
+        std::lock_guard<std::mutex> lock(reactor.mutex);
+        auto entry = reactor.app_socks.find(app_sock);
+        if (entry != reactor.app_socks.end()) {
+            reactor.release(entry, -1);
+        }
+    }
+};
+
+std::atomic<size_t> socks_reactor::pending_count(0);
+
 FHReplacedPrototype(int, connect)(int sock, const struct sockaddr *addr, socklen_t addr_len) {
     if (skia::instance().should_bypass(sock) || skia::instance().should_bypass(addr)) {
         return FHOriginal(connect)(sock, addr, addr_len);
     }
 
-    struct in6_addr target_addr;
-    in_port_t target_port;
-    bool ipv6;
-    skia::instance().extract_target(addr, target_addr, target_port, ipv6);
+    if (socks_reactor::is_pending(sock)) {
+        errno = EALREADY;
+        return -1;
+    }
+
+    // the name behind a fake address is looked up here, once for the connect
+    connect_target target;
+    skia::instance().extract_target(addr, target);
     debug({
         char buffer[INET6_ADDRSTRLEN];
-        log("connect: %s:%u", inet_ntop(ipv6 ? AF_INET6 : AF_INET, &target_addr, buffer, sizeof(buffer)), ntohs(target_port));
+        log("connect: %s:%u", inet_ntop(target.ipv6 ? AF_INET6 : AF_INET, &target.addr, buffer, sizeof(buffer)), ntohs(target.port));
     });
 
-    if (skia::instance().should_bypass(target_addr, target_port, ipv6)) {
+    if (skia::instance().should_bypass(target.addr, target.port, target.ipv6)) {
         return FHOriginal(connect)(sock, addr, addr_len);
     }
 
     int new_sock;
-    socket_address proxy = skia::instance().query_proxy(target_addr, target_port, ipv6);
-    bool result = proxy.addr == 0 ? make_direct(new_sock, target_addr, target_port, ipv6) : make_proxied(new_sock, target_addr, target_port, ipv6, proxy);
+    proxy_list proxies = skia::instance().query_proxy(target);
+    bool nonblock = fcntl(sock, F_GETFL, NULL) & O_NONBLOCK;
+    if (nonblock && !proxies.direct()) {
+        if (socks_reactor::instance().start(sock, target, proxies)) {
+            errno = EINPROGRESS;
+        } else {
+            errno = ETIMEDOUT;
+        }
+        return -1;
+    }
+    // blocking sockets fail over through the list one entry at a time, with
+    // the slot of a fake target pinned until connect returns
+    in_addr_t pinned = target.addr.__u6_addr.__u6_addr32[target.ipv6 ? 3 : 0];
+    if (!resolve_table::instance().pin(pinned, target.name)) {
+        pinned = 0;
+    }
+    bool result = proxies.count == 0 && make_direct(new_sock, target);
+    for (size_t i = 0; !result && i < proxies.count; i++) {
+        const proxy_address &proxy = proxies.proxies[i];
+        result = proxy.addr == 0 ? make_direct(new_sock, target) : make_proxied(new_sock, target, proxy);
+    }
+    if (pinned != 0) {
+        resolve_table::instance().unpin(pinned);
+    }
     if (result) {
-        bool nonblock = fcntl(sock, F_GETFL, NULL) & O_NONBLOCK;
+        inherit_options(sock, new_sock);
         dup2(new_sock, sock);
         close(new_sock);
         if (nonblock) {
@@ -289,30 +1045,119 @@ FHReplacedPrototype(int, connect)(int sock, const struct sockaddr *addr, socklen
     }
 }
 
-FHReplacedPrototype(struct hostent *, gethostbyname)(const char *name) {
-    if (skia::instance().should_bypass(name ?: "", "")) {
-        return FHOriginal(gethostbyname)(name);
+FHReplacedPrototype(int, close)(int fd) {
+    socks_reactor::cancel(fd);
+    return FHOriginal(close)(fd);
+}
+
+// Storage for a synthesized hostent. gethostbyname and friends hand out one
+// per thread, getipnodebyname one per call. The magic sits between the hostent
+// and its arrays, at an offset malloc never returns, so freehostent can tell
+// ours apart by h_aliases alone before it looks at the magic.
+struct hostent_storage {
+    struct hostent result;
+    uint64_t magic;
+    char *aliases[1];
+    char *addr_list[2];
+    struct in6_addr addr;
+    char name[NI_MAXHOST];
+};
+
+static const uint64_t hostent_magic = 0x736b69612d686f73ULL;
+static pthread_key_t hostent_key;
+
+static hostent_storage *thread_hostent() {
+    hostent_storage *storage = reinterpret_cast<hostent_storage *>(pthread_getspecific(hostent_key));
+    if (storage == NULL) {
+        storage = reinterpret_cast<hostent_storage *>(malloc(sizeof(hostent_storage)));
+        if (storage == NULL) {
+            return NULL;
+        }
+        pthread_setspecific(hostent_key, storage);
     }
+    return storage;
+}
 
-    static struct hostent result;
-    static char result_name[NI_MAXHOST];
-    static in_addr_t result_addr;
-    static char *result_list[2];
-    strlcpy(result_name, name, sizeof(result_name));
-    result_addr = resolve_table::instance().name_to_addr(result_name);
-    result_list[0] = reinterpret_cast<char *>(&result_addr);
-    result_list[1] = NULL;
-    result.h_addrtype = AF_INET;
-    result.h_length = sizeof(struct in_addr);
-    result.h_name = result_name;
-    result.h_addr_list = result_list + 0;
-    result.h_aliases = result_list + 1;
+static struct hostent *make_hostent(hostent_storage *storage, const char *name, const void *addr, int af) {
+    int addr_len = af == AF_INET6 ? sizeof(struct in6_addr) : sizeof(struct in_addr);
+    strlcpy(storage->name, name, sizeof(storage->name));
+    storage->magic = hostent_magic;
+    memcpy(&storage->addr, addr, addr_len);
+    storage->aliases[0] = NULL;
+    storage->addr_list[0] = reinterpret_cast<char *>(&storage->addr);
+    storage->addr_list[1] = NULL;
+    storage->result.h_addrtype = af;
+    storage->result.h_length = addr_len;
+    storage->result.h_name = storage->name;
+    storage->result.h_addr_list = storage->addr_list;
+    storage->result.h_aliases = storage->aliases;
+    return &storage->result;
+}
+
+static bool is_hostent_storage(struct hostent *result) {
+    hostent_storage *storage = reinterpret_cast<hostent_storage *>(result);
+    return result->h_aliases == storage->aliases && storage->magic == hostent_magic;
+}
+
+static struct hostent *hostent_resolve(hostent_storage *storage, const char *name, int af) {
+    struct in6_addr addr;
+    if (af == AF_INET6) {
+        resolve_table::instance().name_to_addr(name, addr);
+    } else {
+        addr.__u6_addr.__u6_addr32[0] = resolve_table::instance().name_to_addr(name);
+    }
+    struct hostent *result = make_hostent(storage, name, &addr, af);
 
     debug({
         char buffer[INET6_ADDRSTRLEN];
-        log("gethostbyname: %s -> %s", name, inet_ntop(AF_INET, &result.h_addr_list, buffer, sizeof(buffer)));
+        log("gethostbyname: %s -> %s", name, inet_ntop(af, result->h_addr_list[0], buffer, sizeof(buffer)));
     });
-    return &result;
+    return result;
+}
+
+static struct hostent *gethostbyname_resolve(const char *name, int af) {
+    hostent_storage *storage = thread_hostent();
+    if (storage == NULL) {
+        h_errno = NO_RECOVERY;
+        return NULL;
+    }
+    return hostent_resolve(storage, name, af);
+}
+
+FHReplacedPrototype(struct hostent *, gethostbyname)(const char *name) {
+    if (skia::instance().should_bypass(name ?: "", "")) {
+        return FHOriginal(gethostbyname)(name);
+    }
+    return gethostbyname_resolve(name, AF_INET);
+}
+
+FHReplacedPrototype(struct hostent *, gethostbyname2)(const char *name, int af) {
+    if ((af != AF_INET && af != AF_INET6) || skia::instance().should_bypass(name ?: "", "")) {
+        return FHOriginal(gethostbyname2)(name, af);
+    }
+    return gethostbyname_resolve(name, af);
+}
+
+FHReplacedPrototype(struct hostent *, getipnodebyname)(const char *name, int af, int flags, int *error_num) {
+    if ((af != AF_INET && af != AF_INET6) || skia::instance().should_bypass(name ?: "", "")) {
+        return FHOriginal(getipnodebyname)(name, af, flags, error_num);
+    }
+    hostent_storage *storage = reinterpret_cast<hostent_storage *>(malloc(sizeof(hostent_storage)));
+    if (storage == NULL) {
+        if (error_num) {
+            *error_num = NO_RECOVERY;
+        }
+        return NULL;
+    }
+    return hostent_resolve(storage, name, af);
+}
+
+FHReplacedPrototype(void, freehostent)(struct hostent *ip) {
+    if (ip != NULL && is_hostent_storage(ip)) {
+        free(ip);
+        return;
+    }
+    FHOriginal(freehostent)(ip);
 }
 
 FHReplacedPrototype(struct hostent *, gethostbyaddr)(const void *addr, socklen_t len, int type) {
@@ -320,29 +1165,28 @@ FHReplacedPrototype(struct hostent *, gethostbyaddr)(const void *addr, socklen_t
         return FHOriginal(gethostbyaddr)(addr, len, type);
     }
 
-    if (!(len == sizeof(struct in_addr) && type == AF_INET && resolve_table::instance().is_resolved_addr(*reinterpret_cast<const in_addr_t *>(addr)))) {
+    bool ipv6 = type == AF_INET6;
+    struct in6_addr target_addr;
+    if (!((type == AF_INET && len == sizeof(struct in_addr)) || (ipv6 && len == sizeof(struct in6_addr)))) {
+        return FHOriginal(gethostbyaddr)(addr, len, type);
+    }
+    memcpy(&target_addr, addr, len);
+    if (!resolve_table::instance().is_resolved_addr(target_addr, ipv6)) {
         return FHOriginal(gethostbyaddr)(addr, len, type);
     }
 
-    static struct hostent result;
-    static in_addr_t result_addr;
-    static char result_name[NI_MAXHOST];
-    static char *result_list[2];
-    result_addr = *reinterpret_cast<const in_addr_t *>(addr);
-    strlcpy(result_name, resolve_table::instance().addr_to_name(result_addr).c_str(), sizeof(result_name));
-    result_list[0] = reinterpret_cast<char *>(&result_addr);
-    result_list[1] = NULL;
-    result.h_addrtype = AF_INET;
-    result.h_length = sizeof(struct in_addr);
-    result.h_name = result_name;
-    result.h_addr_list = result_list + 0;
-    result.h_aliases = result_list + 1;
+    hostent_storage *storage = thread_hostent();
+    if (storage == NULL) {
+        h_errno = NO_RECOVERY;
+        return NULL;
+    }
+    struct hostent *result = make_hostent(storage, resolve_table::instance().addr_to_name(target_addr, ipv6).c_str(), addr, type);
 
     debug({
         char buffer[INET6_ADDRSTRLEN];
-        log("gethostbyaddr: %s -> %s", inet_ntop(type, addr, buffer, sizeof(buffer)), result.h_name);
+        log("gethostbyaddr: %s -> %s", inet_ntop(type, addr, buffer, sizeof(buffer)), result->h_name);
     });
-    return &result;
+    return result;
 }
 
 static pthread_key_t resolve_key;
@@ -365,38 +1209,114 @@ static bool getaddrinfo_test(const char *hostname, const char *servname, const s
     return get_should_resolve();
 }
 
+// Well known services from /etc/services, so synthesized results rarely need
+// getservbyname, which reads the file under a lock on every call.
+static const struct {
+    const char *name;
+    uint16_t port;
+} service_table[] = {
+    {"ftp-data", 20}, {"ftp", 21}, {"ssh", 22}, {"telnet", 23}, {"smtp", 25},
+    {"domain", 53}, {"http", 80}, {"www", 80}, {"www-http", 80}, {"kerberos", 88},
+    {"pop3", 110}, {"nntp", 119}, {"ntp", 123}, {"imap", 143}, {"imap4", 143},
+    {"snmp", 161}, {"ldap", 389}, {"https", 443}, {"microsoft-ds", 445}, {"kpasswd", 464},
+    {"submission", 587}, {"ipp", 631}, {"ldaps", 636}, {"rsync", 873}, {"ftps", 990},
+    {"imaps", 993}, {"pop3s", 995}, {"socks", 1080}, {"openvpn", 1194}, {"mysql", 3306},
+    {"sip", 5060}, {"sips", 5061}, {"xmpp-client", 5222}, {"xmpp-server", 5269}, {"http-alt", 8080},
+};
+
+static bool service_port(const char *servname, const struct addrinfo *hints, in_port_t &port) {
+    if (servname == NULL) {
+        port = 0;
+        return true;
+    }
+    char *servname_end = NULL;
+    unsigned long number = strtoul(servname, &servname_end, 10);
+    if (servname[0] != '\0' && *servname_end == '\0') {
+        if (number > UINT16_MAX) {
+            return false;
+        }
+        port = htons(static_cast<uint16_t>(number));
+        return true;
+    }
+    if (hints && (hints->ai_flags & AI_NUMERICSERV)) {
+        return false;
+    }
+    for (const auto &service : service_table) {
+        if (strcmp(servname, service.name) == 0) {
+            port = htons(service.port);
+            return true;
+        }
+    }
+    struct servent *serv = getservbyname(servname, NULL);
+    if (serv == NULL) {
+        return false;
+    }
+    port = serv->s_port;
+    return true;
+}
+
+// A synthesized addrinfo with its address and canonical name, allocated as one
+// exact-size block. As with hostent_storage, the magic sits where malloc never
+// places a separate allocation, so the freeaddrinfo hook can tell ours apart.
+struct addrinfo_storage {
+    struct addrinfo info;
+    uint64_t magic;
+    union {
+        struct sockaddr_in v4;
+        struct sockaddr_in6 v6;
+    } addr;
+    char name[1];
+};
+
+static const uint64_t addrinfo_magic = 0x736b69612d616469ULL;
+
+static bool is_addrinfo_storage(struct addrinfo *result) {
+    addrinfo_storage *storage = reinterpret_cast<addrinfo_storage *>(result);
+    return result->ai_addr == reinterpret_cast<struct sockaddr *>(&storage->addr) && storage->magic == addrinfo_magic;
+}
+
 static int getaddrinfo_resolve(const char *hostname, const char *servname, const struct addrinfo *hints, struct addrinfo **res) {
-    struct addrinfo *result = reinterpret_cast<struct addrinfo *>(malloc(sizeof(struct addrinfo)));
-    struct sockaddr_in *result_addr = reinterpret_cast<struct sockaddr_in *>(malloc(sizeof(struct sockaddr_in)));
-    char *result_name = reinterpret_cast<char *>(calloc(NI_MAXHOST, sizeof(char)));
-    if (result == NULL || result_addr == NULL || result_name == NULL) {
-        free(result);
-        free(result_addr);
-        free(result_name);
+    in_port_t port;
+    if (!service_port(servname, hints, port)) {
+        return EAI_SERVICE;
+    }
+    size_t name_len = strlen(hostname);
+    addrinfo_storage *storage = reinterpret_cast<addrinfo_storage *>(malloc(offsetof(addrinfo_storage, name) + name_len + 1));
+    if (storage == NULL) {
         return EAI_MEMORY;
     }
-    memset(result_addr, 0, sizeof(struct sockaddr_in));
-    result_addr->sin_len = sizeof(struct sockaddr_in);
-    result_addr->sin_family = AF_INET;
-    result_addr->sin_addr.s_addr = resolve_table::instance().name_to_addr(hostname);
-    result_addr->sin_port = 0;
-    if (servname) {
-        struct servent *serv = getservbyname(servname, NULL);
-        result_addr->sin_port = serv ? serv->s_port : htons(atoi(servname));
+    // AF_UNSPEC keeps getting the ipv4 form, which works on every network
+    bool ipv6 = hints && hints->ai_family == AF_INET6;
+    struct addrinfo *result = &storage->info;
+    memset(&storage->addr, 0, sizeof(storage->addr));
+    if (ipv6) {
+        struct sockaddr_in6 *result_addr = &storage->addr.v6;
+        result_addr->sin6_len = sizeof(struct sockaddr_in6);
+        result_addr->sin6_family = AF_INET6;
+        resolve_table::instance().name_to_addr(hostname, result_addr->sin6_addr);
+        result_addr->sin6_port = port;
+    } else {
+        struct sockaddr_in *result_addr = &storage->addr.v4;
+        result_addr->sin_len = sizeof(struct sockaddr_in);
+        result_addr->sin_family = AF_INET;
+        result_addr->sin_addr.s_addr = resolve_table::instance().name_to_addr(hostname);
+        result_addr->sin_port = port;
     }
-    strlcpy(result_name, hostname, NI_MAXHOST);
+    memcpy(storage->name, hostname, name_len + 1);
+    storage->magic = addrinfo_magic;
     result->ai_flags = hints ? hints->ai_flags : AI_ADDRCONFIG;
     result->ai_socktype = hints ? hints->ai_socktype : SOCK_STREAM;
     result->ai_protocol = hints ? hints->ai_protocol : IPPROTO_IPV4;
-    result->ai_family = AF_INET;
-    result->ai_addrlen = sizeof(struct sockaddr_in);
-    result->ai_addr = reinterpret_cast<struct sockaddr *>(result_addr);
-    result->ai_canonname = result_name;
+    result->ai_family = ipv6 ? AF_INET6 : AF_INET;
+    result->ai_addrlen = ipv6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+    result->ai_addr = reinterpret_cast<struct sockaddr *>(&storage->addr);
+    result->ai_canonname = storage->name;
     result->ai_next = NULL;
 
     debug({
         char buffer[INET6_ADDRSTRLEN];
-        log("getaddrinfo: %s:%s -> %s:%u", hostname, servname, inet_ntop(AF_INET, &reinterpret_cast<struct sockaddr_in *>(result->ai_addr)->sin_addr, buffer, sizeof(buffer)), ntohs(reinterpret_cast<struct sockaddr_in *>(result->ai_addr)->sin_port));
+        const void *addr = ipv6 ? static_cast<const void *>(&storage->addr.v6.sin6_addr) : static_cast<const void *>(&storage->addr.v4.sin_addr);
+        log("getaddrinfo: %s:%s -> %s:%u", hostname, servname, inet_ntop(result->ai_family, addr, buffer, sizeof(buffer)), ntohs(port));
     });
     *res = result;
     return 0;
@@ -409,12 +1329,20 @@ FHReplacedPrototype(int, getaddrinfo)(const char *hostname, const char *servname
     return getaddrinfo_resolve(hostname, servname, hints, res);
 }
 
+FHReplacedPrototype(void, freeaddrinfo)(struct addrinfo *ai) {
+    if (ai != NULL && is_addrinfo_storage(ai)) {
+        free(ai);
+        return;
+    }
+    FHOriginal(freeaddrinfo)(ai);
+}
+
 FHFunction(int, getaddrinfo_async_start, mach_port_t *p, const char *hostname, const char *servname, const struct addrinfo *hints, getaddrinfo_async_callback callback, void *context) {
     if (getaddrinfo_test(hostname, servname, hints)) {
         return FHOriginal(getaddrinfo_async_start)(p, hostname, servname, hints, callback, context);
     }
     int status = EAI_MEMORY;
-    if (mach_port_allocate(mach_task_self(), MACH_PORT_RIGHT_RECEIVE, p) == 0) {
+    if (mach_port_allocate(mach_task_self(), MACH_PORT_RIGHT_RECEIVE, p) != KERN_SUCCESS) {
         *p = MACH_PORT_NULL;
         return status;
     }
@@ -430,31 +1358,53 @@ FHFunction(int, getaddrinfo_async_start, mach_port_t *p, const char *hostname, c
     return status;
 }
 
+static bool getnameinfo_target(const struct sockaddr *sa, socklen_t salen, struct in6_addr &target_addr, in_port_t &target_port, bool &ipv6) {
+    if (salen == sizeof(struct sockaddr_in) && sa->sa_family == AF_INET) {
+        ipv6 = false;
+        target_addr.__u6_addr.__u6_addr32[0] = reinterpret_cast<const struct sockaddr_in *>(sa)->sin_addr.s_addr;
+        target_port = reinterpret_cast<const struct sockaddr_in *>(sa)->sin_port;
+        return true;
+    }
+    if (salen == sizeof(struct sockaddr_in6) && sa->sa_family == AF_INET6) {
+        ipv6 = true;
+        target_addr = reinterpret_cast<const struct sockaddr_in6 *>(sa)->sin6_addr;
+        target_port = reinterpret_cast<const struct sockaddr_in6 *>(sa)->sin6_port;
+        return true;
+    }
+    return false;
+}
+
 static bool getnameinfo_test(const struct sockaddr *sa, socklen_t salen, int flags) {
     if (sa == NULL) {
         return true;
     }
-    if (!(salen == sizeof(struct sockaddr_in) && sa->sa_family == AF_INET && resolve_table::instance().is_resolved_addr(reinterpret_cast<const struct sockaddr_in *>(sa)->sin_addr.s_addr))) {
+    struct in6_addr target_addr;
+    in_port_t target_port;
+    bool ipv6;
+    if (!getnameinfo_target(sa, salen, target_addr, target_port, ipv6) || !resolve_table::instance().is_resolved_addr(target_addr, ipv6)) {
         return true;
     }
     return get_should_resolve();
 }
 
 static int getnameinfo_resolve(const struct sockaddr *sa, socklen_t salen, char *host, socklen_t hostlen, char *serv, socklen_t servlen, int flags) {
-    const struct sockaddr_in *sa_in = reinterpret_cast<const struct sockaddr_in *>(sa);
+    struct in6_addr target_addr;
+    in_port_t target_port;
+    bool ipv6;
+    getnameinfo_target(sa, salen, target_addr, target_port, ipv6);
     if (host != NULL && hostlen > 0) {
-        if (strlcpy(host, resolve_table::instance().addr_to_name(sa_in->sin_addr.s_addr).c_str(), hostlen) >= hostlen) {
+        if (strlcpy(host, resolve_table::instance().addr_to_name(target_addr, ipv6).c_str(), hostlen) >= hostlen) {
             return EAI_OVERFLOW;
         }
     }
     if (serv != NULL && servlen > 0) {
-        struct servent *serv_ent = getservbyport(sa_in->sin_port, NULL);
+        struct servent *serv_ent = getservbyport(target_port, NULL);
         if (serv_ent) {
             if (strlcpy(serv, serv_ent->s_name, servlen) >= servlen) {
                 return EAI_OVERFLOW;
             }
         } else {
-            if (snprintf(serv, servlen, "%d", ntohs(sa_in->sin_port)) >= servlen) {
+            if (snprintf(serv, servlen, "%d", ntohs(target_port)) >= servlen) {
                 return EAI_OVERFLOW;
             }
         }
@@ -462,7 +1412,7 @@ static int getnameinfo_resolve(const struct sockaddr *sa, socklen_t salen, char
 
     debug({
         char buffer[INET6_ADDRSTRLEN];
-        log("getnameinfo: %s:%u -> %s:%s", inet_ntop(sa->sa_family, &reinterpret_cast<const struct sockaddr_in *>(sa)->sin_addr, buffer, sizeof(buffer)), ntohs(reinterpret_cast<const struct sockaddr_in *>(sa)->sin_port), host, serv);
+        log("getnameinfo: %s:%u -> %s:%s", inet_ntop(sa->sa_family, &target_addr, buffer, sizeof(buffer)), ntohs(target_port), host, serv);
     });
     return 0;
 }
@@ -479,13 +1429,13 @@ FHFunction(int, getnameinfo_async_start, mach_port_t *p, const struct sockaddr *
         return FHOriginal(getnameinfo_async_start)(p,sa, salen, flags, callback, context);
     }
     int status = EAI_MEMORY;
-    if (mach_port_allocate(mach_task_self(), MACH_PORT_RIGHT_RECEIVE, p) == 0) {
+    if (mach_port_allocate(mach_task_self(), MACH_PORT_RIGHT_RECEIVE, p) != KERN_SUCCESS) {
         *p = MACH_PORT_NULL;
         return status;
     }
     char *host = reinterpret_cast<char *>(calloc(NI_MAXHOST, sizeof(char)));
     char *serv = reinterpret_cast<char *>(calloc(NI_MAXSERV, sizeof(char)));
-    if (host == NULL || serv == NULL || (status = getnameinfo_resolve(sa, salen, host, sizeof(host), serv, sizeof(serv), flags)) != 0) {
+    if (host == NULL || serv == NULL || (status = getnameinfo_resolve(sa, salen, host, NI_MAXHOST, serv, NI_MAXSERV, flags)) != 0) {
         mach_port_destroy(mach_task_self(), *p);
         *p = MACH_PORT_NULL;
         free(host);
@@ -507,10 +1457,16 @@ FHFunction(JSValueRef, _ZL29_JSDnsResolveFunctionCallbackPK15OpaqueJSContextP13O
 
 FHConstructor {
     pthread_key_create(&resolve_key, NULL);
+    pthread_key_create(&hostent_key, free);
     FHHook(connect);
+    FHHook(close);
     FHHook(gethostbyname);
+    FHHook(gethostbyname2);
     FHHook(gethostbyaddr);
+    FHHook(getipnodebyname);
+    FHHook(freehostent);
     FHHook(getaddrinfo);
+    FHHook(freeaddrinfo);
     FHHook(getaddrinfo_async_start);
     FHHook(getnameinfo);
     FHHook(getnameinfo_async_start);
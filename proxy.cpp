@@ -0,0 +1,109 @@
+#include "proxy.hpp"
+#include <string.h>
+
+size_t proxy_cache::hash(uint32_t key_hash, uint16_t port) {
+    // the port mixed into the key hash, with the high bits folded back in
+    // since shards and buckets take the low ones
+    uint64_t value = (static_cast<uint64_t>(key_hash) << 16 | port) * 0x9e3779b97f4a7c15ULL;
+    return static_cast<size_t>(value ^ (value >> 32));
+}
+
+bool proxy_cache::matches(const entry &e, size_t hash, const char *name, size_t name_len, uint16_t port) {
+    return e.hash == hash && e.port == port && e.name.length() == name_len && memcmp(e.name.data(), name, name_len) == 0;
+}
+
+void proxy_cache::unlink(shard &s, size_t index) {
+    entry &e = s.entries[index];
+    uint32_t *link = &s.buckets[(e.hash / shard_count) % shard_capacity];
+    while (*link != 0 && *link != index + 1) {
+        link = &s.entries[*link - 1].next;
+    }
+    if (*link != 0) {
+        *link = e.next;
+    }
+    e.next = 0;
+}
+
+bool proxy_cache::find(const char *name, size_t name_len, uint32_t key_hash, uint16_t port, proxy_list &proxies) {
+    size_t value = hash(key_hash, port);
+    shard &s = shards[value % shard_count];
+    bool found = false;
+    s.mutex.lock_shared();
+    if (s.entries) {
+        for (uint32_t next = s.buckets[(value / shard_count) % shard_capacity]; next != 0; next = s.entries[next - 1].next) {
+            entry &e = s.entries[next - 1];
+            if (matches(e, value, name, name_len, port)) {
+                if (e.expires > clock::now()) {
+                    e.referenced.store(true, std::memory_order_relaxed);
+                    proxies = e.proxies;
+                    found = true;
+                }
+                break;
+            }
+        }
+    }
+    s.mutex.unlock_shared();
+    (found ? s.hits : s.misses).fetch_add(1, std::memory_order_relaxed);
+    return found;
+}
+
+bool proxy_cache::insert(const char *name, size_t name_len, uint32_t key_hash, uint16_t port, const proxy_list &proxies, uint32_t ttl) {
+    size_t value = hash(key_hash, port);
+    shard &s = shards[value % shard_count];
+    clock::time_point now = clock::now();
+    clock::time_point expires = ttl > 0 ? now + std::chrono::seconds(ttl) : clock::time_point::max();
+    s.mutex.lock();
+    if (!s.entries) {
+        s.entries.reset(new entry[shard_capacity]);
+        s.buckets.reset(new uint32_t[shard_capacity]());
+    }
+    uint32_t *bucket = &s.buckets[(value / shard_count) % shard_capacity];
+    for (uint32_t next = *bucket; next != 0; next = s.entries[next - 1].next) {
+        entry &e = s.entries[next - 1];
+        if (matches(e, value, name, name_len, port)) {
+            e.proxies = proxies;
+            e.expires = expires;
+            s.mutex.unlock();
+            return false;
+        }
+    }
+    size_t index;
+    bool evicted = s.size == shard_capacity;
+    if (!evicted) {
+        index = s.size++;
+    } else {
+        // CLOCK: expired entries go first, referenced ones get a second chance
+        while (true) {
+            entry &e = s.entries[s.hand];
+            if (e.expires <= now || !e.referenced.exchange(false, std::memory_order_relaxed)) {
+                break;
+            }
+            s.hand = (s.hand + 1) % shard_capacity;
+        }
+        index = s.hand;
+        s.hand = (s.hand + 1) % shard_capacity;
+        unlink(s, index);
+        s.evictions.fetch_add(1, std::memory_order_relaxed);
+    }
+    entry &e = s.entries[index];
+    e.name.assign(name, name_len);
+    e.port = port;
+    e.hash = value;
+    e.proxies = proxies;
+    e.expires = expires;
+    e.referenced.store(false, std::memory_order_relaxed);
+    e.next = *bucket;
+    *bucket = static_cast<uint32_t>(index + 1);
+    s.mutex.unlock();
+    return evicted;
+}
+
+proxy_cache::counters proxy_cache::totals() {
+    counters result;
+    for (shard &s : shards) {
+        result.hits += s.hits.load(std::memory_order_relaxed);
+        result.misses += s.misses.load(std::memory_order_relaxed);
+        result.evictions += s.evictions.load(std::memory_order_relaxed);
+    }
+    return result;
+}
@@ -0,0 +1,95 @@
+#include <string>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <shared_mutex>
+#include <arpa/inet.h>
+
+struct socket_address {
+    in_addr_t addr = 0;
+    in_port_t port = 0;
+    socket_address() {}
+    socket_address(in_addr_t addr, in_port_t port): addr(htonl(addr)), port(htons(port)) {}
+};
+
+enum proxy_phase {
+    phase_connect, // tcp connect to the proxy
+    phase_greeting, // socks greeting and its reply
+    phase_reply, // connect request and its reply
+    phase_count,
+};
+
+// Time limits of the phases in milliseconds, 0 for the default. Adaptive
+// timeouts follow the latency observed for each proxy, never exceeding the
+// configured limits.
+struct proxy_timeouts {
+    uint32_t msec[phase_count] = {0, 0, 0};
+    int adaptive = -1; // 1 or 0, -1 for the default
+};
+
+struct proxy_address: socket_address {
+    bool optimistic = false; // send greeting and request in one segment
+    proxy_timeouts timeouts;
+    proxy_address() {}
+};
+
+// Proxies to try in order for one connection. An entry with a zero address is
+// a direct connection, written "DIRECT" in scripts, and ends the list. An empty
+// list is a direct connection too.
+struct proxy_list {
+    static const size_t max_count = 4;
+    proxy_address proxies[max_count];
+    size_t count = 0;
+    bool race = false; // start the second proxy shortly after the first instead of waiting for it to fail
+    bool push(const proxy_address &proxy) {
+        if (count == max_count || (count > 0 && proxies[count - 1].addr == 0)) {
+            return false;
+        }
+        proxies[count++] = proxy;
+        return true;
+    }
+    bool direct() const { return count == 0 || proxies[0].addr == 0; }
+};
+
+class proxy_cache {
+private:
+    typedef std::chrono::steady_clock clock;
+    struct entry {
+        std::string name;
+        uint16_t port = 0;
+        size_t hash = 0;
+        proxy_list proxies;
+        clock::time_point expires;
+        std::atomic<bool> referenced{false};
+        uint32_t next = 0; // 1-based index of the next entry in the bucket, 0 for none
+    };
+    struct shard {
+        std::shared_timed_mutex mutex;
+        std::unique_ptr<entry[]> entries;
+        std::unique_ptr<uint32_t[]> buckets; // 1-based index of the first entry, 0 for none
+        size_t size = 0;
+        size_t hand = 0;
+        // relaxed, and per shard so that lookups on different shards do not
+        // share a cache line
+        std::atomic<uint32_t> hits{0}, misses{0}, evictions{0};
+    };
+    static const size_t shard_count = 16;
+    const size_t shard_capacity;
+    shard shards[shard_count];
+    static size_t hash(uint32_t key_hash, uint16_t port);
+    static bool matches(const entry &e, size_t hash, const char *name, size_t name_len, uint16_t port);
+    void unlink(shard &s, size_t index);
+public:
+    struct counters {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0; // entries dropped to make room, expired or not
+    };
+    proxy_cache(size_t capacity): shard_capacity((capacity + shard_count - 1) / shard_count) {}
+    // Keys come with a hash from the caller, computed once along with the key
+    // and the same for equal keys.
+    bool find(const char *name, size_t name_len, uint32_t key_hash, uint16_t port, proxy_list &proxies);
+    // Returns true when an entry was evicted to make room.
+    bool insert(const char *name, size_t name_len, uint32_t key_hash, uint16_t port, const proxy_list &proxies, uint32_t ttl);
+    counters totals();
+};
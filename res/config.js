@@ -11,13 +11,98 @@
  * isHostResolvable(host: string): boolean
  * isHostInNetwork(host: string, network: string, netmask: string): boolean
  *
+ * proxyHealth(proxy: object): {rtt: number, failures: number, checked: number}
+ * the latest result of the health check skiad runs every minute for each
+ * shadowsocks instance. rtt is a moving average in milliseconds, failures
+ * counts consecutive failed checks and checked is the time of the last
+ * check in seconds. null for proxies that have not been checked.
+ *
+ * bestProxy(group: object[], mode: string): object
+ * picks a proxy from the group, leaving out ones that failed 3 checks in
+ * a row. the default mode picks the lowest latency, and 'weighted' picks
+ * at random with weights inverse to latency. combine it with ttl so the
+ * choice is made again as latency changes.
+ *
+ * Predefined Classes
+ *
+ * new DomainSet(domains: string[]): DomainSet
+ * DomainSet.add(domains: string[]): void
+ * DomainSet.contains(host: string): boolean
+ * a native set of domains, each matched with all its subdomains. build
+ * it once at the top level, its lookups take the same time no matter
+ * how many domains it holds.
+ *
+ * new NetworkSet(networks: string[]): NetworkSet
+ * NetworkSet.add(networks: string[]): void
+ * NetworkSet.contains(address: string): boolean
+ * a native set of ipv4 and ipv6 networks written like the ones in rules.
+ * contains only accepts ip addresses, use dnsResolve for host names.
+ *
+ */
+
+/*
+ * The config script may define this array of rules, which are compiled
+ * into native matchers when an application starts and checked in order
+ * before queryProxy is called. The first matching rule decides.
+ *
+ * rules: [{apps: string[], domains: string[], networks: string[], ports: number[], proxy: object, script: boolean}]
+ * @apps - bundle identifiers or process names the rule applies to.
+ * @domains - domains matched with all their subdomains.
+ * @networks - networks such as '10.0.0.0/8', '10.0.0.0/255.0.0.0' or
+ *             'fc00::/7', matched against destination ip addresses.
+ * @ports - destination port numbers.
+ * @proxy - result object for the matched connections, the same as the one
+ *          returned by queryProxy. use null value to bypass proxy.
+ * @script - call queryProxy for the matched connections instead.
+ * a rule matches when all of its conditions match, and a rule without
+ * conditions matches every connection. connections that match no rule
+ * are passed to queryProxy.
+ * networks never resolve host names, so a host name that resolves into a
+ * listed network is not matched, unlike isHostInNetwork. and as rules come
+ * first, checks in queryProxy such as isPlainHostName only see connections
+ * no rule decided. put a rule with script: true ahead of the others for
+ * connections that need such checks first.
+ *
+ */
+
+/*
+ * The config script may define this object to limit how long each phase
+ * of a proxied connection may take, in milliseconds.
+ *
+ * timeouts: {connect: number, greeting: number, reply: number, adaptive: boolean}
+ * @connect - tcp connection to the proxy. the default value is 10000.
+ * @greeting - socks greeting and its reply. the default value is 10000.
+ * @reply - connect request and its reply, which includes reaching the
+ *          destination. the default value is 10000.
+ * @adaptive - whether derive each limit from the latency recently seen
+ *             for the proxy, as four times its 95th percentile but no
+ *             less than 200 milliseconds, so a stalled fast proxy fails
+ *             over quickly. the limits above stay the upper bounds.
+ *             the default value is false.
+ *
+ */
+
+/*
+ * The config script may define this object to tune what Skia writes to
+ * the system log. messages are handed to syslog by a background thread.
+ *
+ * logging: {level: string, sample: number, rate: number}
+ * @level - least severe messages kept, one of 'error', 'notice' and 'info'.
+ *          connections are logged at notice level and failures at error.
+ *          the default value is 'notice'.
+ * @sample - keep one in this many messages below the error level from the
+ *           same place in the code. the default value is 1.
+ * @rate - messages per second kept from the same place in the code, the
+ *         rest are counted on the next one kept. use 0 for no limit.
+ *         the default value is 20.
+ *
  */
 
 /*
  * The config script must define this function, which will be called
- * by Skia for every network connection that is made by applications.
+ * by Skia for every network connection that is not decided by the rules.
  *
- * queryProxy(app: string, host: string, port: number): {host: string, port: number, noCache: boolean}
+ * queryProxy(app: string, host: string, port: number): {host: string, port: number, noCache: boolean, ttl: number, optimistic: boolean}
  * @app - bundle identifier of the application that made the connection.
  *        if it is not available then the value will be the process name.
  * @host - destination host name or ip address.
@@ -27,90 +112,101 @@
  *                 use null value to bypass proxy.
  * @returns.port - port number of the designated proxy server.
  *                 it must be a positive integer.
- * @returns.noCache - whether cache the result or not. the cache will
- *                    persist until the application is terminated.
+ * @returns.noCache - whether cache the result or not. the cache holds
+ *                    a few thousand recent results per application and
+ *                    drops the least used ones when it is full.
  *                    the default value is false.
+ * @returns.ttl - seconds before the cached result expires. use 0 to keep
+ *                it until it is dropped from the cache.
+ *                the default value is 0.
+ * @returns.optimistic - whether send the socks greeting and connect request
+ *                       together, saving one round trip. only use it for
+ *                       proxies that accept no authentication, such as
+ *                       local shadowsocks instances. proxies that reject it
+ *                       are spoken to step by step afterwards.
+ *                       the default value is false.
+ * @returns.timeouts - time limits of this proxy, in the same form as the
+ *                     global timeouts below, overriding them.
+ *
+ * Instead of a single proxy, the result may list up to 4 proxies to try in
+ * order, either as an array or as {proxies: [...], race: true, noCache, ttl}.
+ * the string 'DIRECT' in the list stands for a direct connection and ends it.
+ * proxies that failed to connect or greet are skipped for 30 seconds.
+ * @returns.race - whether start the next proxy 250 milliseconds after the
+ *                 previous one instead of waiting for it to fail, keeping
+ *                 the first that gets through. it applies to non-blocking
+ *                 sockets, blocking ones always try the list in order.
+ *                 the default value is false.
  *
  */
 
+// Local instances answer within milliseconds, so give up on them early.
+var timeouts = {connect: 2000, greeting: 2000, reply: 10000, adaptive: true};
+
+// You can have as many proxies as you wish.
+var proxies = [
+  {host: '127.0.0.1', port: 2000, optimistic: true},
+  {host: '127.0.0.1', port: 2001, optimistic: true}
+];
+
+var rules = [
+  // Bypass some internal networks. only ip addresses are matched here.
+  {networks: ['222.205.0.0/16', '210.32.0.0/16'], proxy: null},
+
+  // Bypass some internal domains.
+  {domains: ['zju.edu.cn', 'cc98.org', 'nexushd.org'], proxy: null},
+
+  // Some apps are fucked by GFW.
+  {apps: ['com.facebook.Paper', 'com.facebook.Facebook', 'com.atebits.Tweetie2'], proxy: proxies[0]},
+
+  // Or if you would like to use a different proxy on some occasions.
+  {apps: ['com.google.ingress'], proxy: proxies[1]},
+
+  // Now it is time for a long long list, which can hold thousands of domains.
+  {domains: [
+    'google.com',
+    'gmail.com',
+    'gstatic.com',
+    'googleusercontent.com',
+    'googleapis.com',
+    'facebook.com',
+    'fbcdn.net',
+    'twitter.com',
+    'twimg.com',
+    't.co'
+  ], proxy: proxies[0]}
+];
+
+var streamingDomains = new DomainSet([
+  'youtube.com',
+  'googlevideo.com',
+  'ytimg.com'
+]);
+
 function queryProxy(app, host, port) {
   // These destinations are always connected directly and you do not need to check them here.
-  // 127.0.0.1/8, 10.0.0.0/255.0.0.0, 172.16.0.0/255.240.0.0, 192.168.0.0/255.255.0.0 and localhost.
-
-  // You can have as many proxies as you wish.
-  var proxies = [
-    {host: '127.0.0.1', port: 2000},
-    {host: '127.0.0.1', port: 2001}
-  ];
+  // 127.0.0.0/8, 10.0.0.0/8, 172.16.0.0/12, 192.168.0.0/16, 100.64.0.0/10, 169.254.0.0/16,
+  // ::1, fc00::/7, fe80::/10 and localhost.
 
   // This connection should not leave your local network.
+  // Plain host names matched by the app rules above are proxied all the same.
   if (isPlainHostName(host)) {
     return null;
   }
 
-  // Bypass some internal networks.
-  var internalNetworks = [
-    ['222.205.0.0', '255.255.0.0'],
-    ['210.32.0.0',  '255.255.0.0']
-  ];
-  for (var i = 0; i < internalNetworks.length; i++) {
-    if (isHostInNetwork(host, internalNetworks[i][0], internalNetworks[i][1])) {
-      return null;
-    }
-  }
-
-  // Bypass some internal domains.
-  var internalDomains = [
-    'zju.edu.cn',
-    'cc98.org',
-    'nexushd.org'
-  ];
-  for (i = 0; i < internalDomains.length; i++) {
-    if (isHostNameInDomain(host, internalDomains[i])) {
-      return null;
-    }
-  }
-
-  // Some apps are fucked by GFW.
-  var blockedApps = [
-    'com.facebook.Paper',
-    'com.facebook.Facebook',
-    'com.atebits.Tweetie2'
-  ];
-  for (i = 0; i < blockedApps.length; i++) {
-    if (app == blockedApps[i]) {
-      return proxies[0];
-    }
+  // Large lists that need more than a rule can be checked with a DomainSet.
+  if (port == 443 && streamingDomains.contains(host)) {
+    return proxies[1];
   }
 
-  // Or if you would like to use a different proxy on some occasions.
-  if (app == 'com.google.ingress') {
-    return proxies[1];
+  // Fall back to the other proxy, and finally go direct, when one is down.
+  if (port == 993) {
+    return [proxies[0], proxies[1], 'DIRECT'];
   }
 
-  // Now it is time for a long long list.
-  // Here we do not iterate over an array for better performance.
-  var blockedDomains = {
-    'google.com': true,
-    'gmail.com': true,
-    'gstatic.com': true,
-    'googleusercontent.com': true,
-    'googleapis.com': true,
-    'facebook.com': true,
-    'fbcdn.net': true,
-    'twitter.com': true,
-    'twimg.com': true,
-    't.co': true
-  };
-  var dotPosition = 0;
-  var hostSubstring = host;
-  while (dotPosition >= 0) {
-    if (blockedDomains[hostSubstring]) {
-      // Random proxy, well, if you like.
-      return proxies[Math.floor(Math.random() * proxies.length)];
-    }
-    dotPosition = host.indexOf('.', dotPosition + 1);
-    hostSubstring = host.slice(dotPosition + 1);
+  // Spread over the proxies, favouring the faster ones.
+  if (port == 5228) {
+    return {proxies: [bestProxy(proxies, 'weighted')], ttl: 300};
   }
 
   // Finally, we may use direct connection as default.
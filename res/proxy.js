@@ -1,4 +1,5 @@
 var __skia_dnsCache = {};
+var __skia_networkCache = {};
 
 function primaryIpAddress() {
   var addresses = __skia_primaryAddresses();
@@ -41,8 +42,11 @@ function hostNameDomainLevel(hostname) {
 
 function isHostNameInDomain(hostname, domain) {
   hostname = hostname.toLowerCase();
-  domain = domain.toLowerCase();
-  return (hostname.substring(hostname.length - domain.length, hostname.length) == domain) ? true : false;
+  domain = domain.toLowerCase().replace(/^\.+/, '');
+  if (hostname == domain) {
+    return true;
+  }
+  return (hostname.substring(hostname.length - domain.length - 1, hostname.length) == '.' + domain) ? true : false;
 }
 
 function isHostResolvable(host) {
@@ -53,21 +57,56 @@ function isHostResolvable(host) {
 function isHostInNetwork(host, network, netmask) {
   var address = dnsResolve(host);
   if (address) {
-    var addressParts = address.split('.');
-    var networkParts = network.split('.');
-    var netmaskParts = netmask.split('.');
-    if ((addressParts.length == netmaskParts.length) && (networkParts.length == netmaskParts.length)) {
-      for (var i = 0; i < netmaskParts.length; i++) {
-        if ((addressParts[i] & netmaskParts[i]) != (networkParts[i] & netmaskParts[i])) {
-          return false;
-        }
-      }
-      return true;
+    var key = network + '/' + netmask;
+    if (!__skia_networkCache.hasOwnProperty(key)) {
+      __skia_networkCache[key] = new NetworkSet(key);
     }
+    return __skia_networkCache[key].contains(address);
   }
   return false;
 }
 
+function proxyHealth(proxy) {
+  return __skia_proxyHealth(proxy.host, proxy.port);
+}
+
+function bestProxy(group, mode) {
+  // Proxies failing their recent checks are left out unless all of them are.
+  var candidates = [];
+  for (var i = 0; i < group.length; i++) {
+    var health = proxyHealth(group[i]);
+    if (!health || health.failures < 3) {
+      candidates.push({proxy: group[i], rtt: health && health.rtt > 0 ? health.rtt : null});
+    }
+  }
+  if (!candidates.length) {
+    return group.length ? group[0] : null;
+  }
+  var known = candidates.filter(function(candidate) { return candidate.rtt !== null; });
+  if (mode == 'weighted') {
+    // Pick at random, weighted by the inverse of latency. Unchecked proxies
+    // weigh as much as an average one.
+    var average = 0;
+    for (var i = 0; i < known.length; i++) {
+      average += 1 / known[i].rtt / known.length;
+    }
+    var weights = candidates.map(function(candidate) { return candidate.rtt !== null ? 1 / candidate.rtt : (average || 1); });
+    var total = weights.reduce(function(sum, weight) { return sum + weight; }, 0);
+    var point = Math.random() * total;
+    for (var i = 0; i < candidates.length; i++) {
+      point -= weights[i];
+      if (point < 0) {
+        return candidates[i].proxy;
+      }
+    }
+    return candidates[candidates.length - 1].proxy;
+  }
+  if (!known.length) {
+    return candidates[0].proxy;
+  }
+  return known.reduce(function(best, candidate) { return candidate.rtt < best.rtt ? candidate : best; }).proxy;
+}
+
 function __skia_queryProxy(app, host, port) {
   __skia_dnsCache = {};
   var result = queryProxy(app, host, port);
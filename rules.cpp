@@ -0,0 +1,278 @@
+#include "rules.hpp"
+#include <algorithm>
+#include <ctype.h>
+#include <string.h>
+#include <stdlib.h>
+
+uint64_t domain_set::hash(uint32_t parent, const char *label, size_t label_len) {
+    // FNV-1a over the parent node and the lowercased label
+    uint64_t value = 14695981039346656037ULL;
+    for (size_t i = 0; i < sizeof(parent); i++) {
+        value = (value ^ ((parent >> (i * 8)) & 0xff)) * 1099511628211ULL;
+    }
+    for (size_t i = 0; i < label_len; i++) {
+        value = (value ^ static_cast<uint8_t>(tolower(label[i]))) * 1099511628211ULL;
+    }
+    return value;
+}
+
+uint32_t domain_set::find_child(uint32_t parent, const char *label, size_t label_len, uint64_t label_hash) const {
+    size_t mask = edges.size() - 1;
+    for (size_t slot = label_hash & mask; edges[slot].child != 0; slot = (slot + 1) & mask) {
+        const edge &e = edges[slot];
+        if (e.hash == label_hash && e.parent == parent && e.label_len == label_len && strncasecmp(labels.data() + e.label_offset, label, label_len) == 0) {
+            return e.child;
+        }
+    }
+    return 0;
+}
+
+void domain_set::grow() {
+    std::vector<edge> old_edges(edges.size() * 2);
+    old_edges.swap(edges);
+    size_t mask = edges.size() - 1;
+    for (const edge &e : old_edges) {
+        if (e.child != 0) {
+            size_t slot = e.hash & mask;
+            while (edges[slot].child != 0) {
+                slot = (slot + 1) & mask;
+            }
+            edges[slot] = e;
+        }
+    }
+}
+
+void domain_set::insert(const std::string &domain, uint32_t value) {
+    if (value == 0) {
+        return;
+    }
+    const char *begin = domain.c_str();
+    const char *end = begin + domain.length();
+    while (begin < end && *begin == '.') {
+        begin++;
+    }
+    while (end > begin && end[-1] == '.') {
+        end--;
+    }
+    if (begin == end) {
+        return;
+    }
+    uint32_t node = 0;
+    while (end > begin) {
+        const char *label = end;
+        while (label > begin && label[-1] != '.') {
+            label--;
+        }
+        size_t label_len = end - label;
+        uint64_t label_hash = hash(node, label, label_len);
+        uint32_t child = find_child(node, label, label_len, label_hash);
+        if (child == 0) {
+            if ((edge_count + 1) * 4 > edges.size() * 3) {
+                grow();
+            }
+            child = static_cast<uint32_t>(values.size());
+            values.push_back(0);
+            size_t mask = edges.size() - 1;
+            size_t slot = label_hash & mask;
+            while (edges[slot].child != 0) {
+                slot = (slot + 1) & mask;
+            }
+            edge &e = edges[slot];
+            e.hash = label_hash;
+            e.parent = node;
+            e.child = child;
+            e.label_offset = static_cast<uint32_t>(labels.length());
+            e.label_len = static_cast<uint32_t>(label_len);
+            for (size_t i = 0; i < label_len; i++) {
+                labels.push_back(tolower(label[i]));
+            }
+            edge_count++;
+        }
+        node = child;
+        end = label > begin ? label - 1 : begin;
+    }
+    if (values[node] == 0 || value < values[node]) {
+        values[node] = value;
+    }
+}
+
+uint32_t domain_set::find(const char *host, size_t host_len) const {
+    const char *begin = host;
+    const char *end = host + host_len;
+    while (end > begin && end[-1] == '.') {
+        end--;
+    }
+    uint32_t result = 0;
+    uint32_t node = 0;
+    while (end > begin) {
+        const char *label = end;
+        while (label > begin && label[-1] != '.') {
+            label--;
+        }
+        size_t label_len = end - label;
+        node = find_child(node, label, label_len, hash(node, label, label_len));
+        if (node == 0) {
+            break;
+        }
+        if (values[node] != 0 && (result == 0 || values[node] < result)) {
+            result = values[node];
+        }
+        end = label > begin ? label - 1 : begin;
+    }
+    return result;
+}
+
+uint32_t network_set::make_node(const uint8_t *key, size_t prefix_len, uint32_t value) {
+    node n;
+    memcpy(n.key, key, prefix_len / 8);
+    if (prefix_len % 8) {
+        n.key[prefix_len / 8] = key[prefix_len / 8] & (0xff << (8 - prefix_len % 8));
+    }
+    n.prefix_len = static_cast<uint32_t>(prefix_len);
+    n.value = value;
+    nodes.push_back(n);
+    return static_cast<uint32_t>(nodes.size() - 1);
+}
+
+size_t network_set::common_prefix(const uint8_t *a, const uint8_t *b, size_t limit) {
+    size_t length = 0;
+    while (length < limit && a[length / 8] == b[length / 8]) {
+        length += 8;
+    }
+    if (length >= limit) {
+        return limit;
+    }
+    uint8_t difference = a[length / 8] ^ b[length / 8];
+    while (length < limit && !(difference & (0x80 >> (length % 8)))) {
+        length++;
+    }
+    return length;
+}
+
+void network_set::insert(const struct in6_addr &addr, size_t prefix_len, uint32_t value) {
+    if (value == 0) {
+        return;
+    }
+    const uint8_t *key = reinterpret_cast<const uint8_t *>(&addr);
+    if (prefix_len > 128) {
+        prefix_len = 128;
+    }
+    // every node on the way down covers the inserted network
+    uint32_t current = 0;
+    while (nodes[current].prefix_len < prefix_len) {
+        int direction = bit(key, nodes[current].prefix_len);
+        uint32_t next = nodes[current].child[direction];
+        if (next == 0) {
+            uint32_t leaf = make_node(key, prefix_len, value);
+            nodes[current].child[direction] = leaf;
+            return;
+        }
+        size_t common = common_prefix(nodes[next].key, key, std::min<size_t>(nodes[next].prefix_len, prefix_len));
+        if (common == nodes[next].prefix_len) {
+            current = next;
+            continue;
+        }
+        // the networks part ways inside the edge, so split it
+        uint32_t split = make_node(key, common, common == prefix_len ? value : 0);
+        nodes[split].child[bit(nodes[next].key, common)] = next;
+        nodes[current].child[direction] = split;
+        if (common < prefix_len) {
+            uint32_t leaf = make_node(key, prefix_len, value);
+            nodes[split].child[bit(key, common)] = leaf;
+        }
+        return;
+    }
+    if (nodes[current].value == 0 || value < nodes[current].value) {
+        nodes[current].value = value;
+    }
+}
+
+bool network_set::insert(const std::string &network, uint32_t value) {
+    std::string address = network;
+    std::string prefix;
+    size_t slash = network.find('/');
+    if (slash != std::string::npos) {
+        address = network.substr(0, slash);
+        prefix = network.substr(slash + 1);
+    }
+    struct in6_addr addr;
+    bool ipv6;
+    if (!parse(address, addr, ipv6)) {
+        return false;
+    }
+    size_t bits = ipv6 ? 128 : 32;
+    size_t prefix_len = bits;
+    if (prefix.length() > 0) {
+        struct in_addr mask;
+        if (!ipv6 && prefix.find('.') != std::string::npos) {
+            // dotted netmask as used by isInNet
+            if (inet_pton(AF_INET, prefix.c_str(), &mask) != 1) {
+                return false;
+            }
+            uint32_t mask_bits = ntohl(mask.s_addr);
+            prefix_len = 0;
+            while (prefix_len < 32 && (mask_bits & (0x80000000U >> prefix_len))) {
+                prefix_len++;
+            }
+        } else {
+            char *prefix_end = NULL;
+            unsigned long number = strtoul(prefix.c_str(), &prefix_end, 10);
+            if (*prefix_end != '\0' || number > bits) {
+                return false;
+            }
+            prefix_len = number;
+        }
+    }
+    insert(addr, prefix_len + (128 - bits), value);
+    return true;
+}
+
+uint32_t network_set::find(const struct in6_addr &addr) const {
+    const uint8_t *key = reinterpret_cast<const uint8_t *>(&addr);
+    uint32_t result = nodes[0].value;
+    uint32_t current = 0;
+    while (nodes[current].prefix_len < 128) {
+        uint32_t next = nodes[current].child[bit(key, nodes[current].prefix_len)];
+        if (next == 0 || common_prefix(nodes[next].key, key, nodes[next].prefix_len) != nodes[next].prefix_len) {
+            break;
+        }
+        current = next;
+        if (nodes[current].value != 0 && (result == 0 || nodes[current].value < result)) {
+            result = nodes[current].value;
+        }
+    }
+    return result;
+}
+
+uint32_t network_set::find(const struct in_addr &addr) const {
+    struct in6_addr mapped;
+    map(addr, mapped);
+    return find(mapped);
+}
+
+uint32_t network_set::find(const std::string &address) const {
+    struct in6_addr addr;
+    bool ipv6;
+    return parse(address, addr, ipv6) ? find(addr) : 0;
+}
+
+void network_set::map(const struct in_addr &addr_v4, struct in6_addr &addr) {
+    memset(&addr, 0, sizeof(addr));
+    reinterpret_cast<uint8_t *>(&addr)[10] = 0xff;
+    reinterpret_cast<uint8_t *>(&addr)[11] = 0xff;
+    memcpy(reinterpret_cast<uint8_t *>(&addr) + 12, &addr_v4, sizeof(addr_v4));
+}
+
+bool network_set::parse(const std::string &address, struct in6_addr &addr, bool &ipv6) {
+    struct in_addr addr_v4;
+    if (inet_pton(AF_INET, address.c_str(), &addr_v4) == 1) {
+        map(addr_v4, addr);
+        ipv6 = false;
+        return true;
+    }
+    if (inet_pton(AF_INET6, address.c_str(), &addr) == 1) {
+        ipv6 = true;
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,57 @@
+#include <string>
+#include <vector>
+#include <arpa/inet.h>
+
+// Set of domain names matched on label boundaries, stored as a trie of
+// reversed labels. Each domain carries a non-zero value; a lookup returns the
+// smallest value among the domains the host belongs to, or 0 for none.
+class domain_set {
+private:
+    struct edge {
+        uint64_t hash = 0;
+        uint32_t parent = 0, child = 0; // child 0 marks an empty slot, since the root is never a child
+        uint32_t label_offset = 0, label_len = 0;
+    };
+    std::vector<uint32_t> values; // indexed by node, node 0 is the root
+    std::vector<edge> edges; // open addressing, size is a power of two
+    std::string labels;
+    size_t edge_count = 0;
+    static uint64_t hash(uint32_t parent, const char *label, size_t label_len);
+    uint32_t find_child(uint32_t parent, const char *label, size_t label_len, uint64_t label_hash) const;
+    void grow();
+public:
+    domain_set(): values(1, 0), edges(16) {}
+    void insert(const std::string &domain, uint32_t value = 1);
+    uint32_t find(const char *host, size_t host_len) const;
+    uint32_t find(const std::string &host) const { return find(host.c_str(), host.length()); }
+    size_t size() const { return values.size() - 1; }
+};
+
+// Set of IPv4 and IPv6 networks stored as a path-compressed binary prefix
+// tree, so a lookup visits at most one node per stored prefix length on the
+// way down. IPv4 networks live under ::ffff:0:0/96. Each network carries a
+// non-zero value; a lookup returns the smallest value among the networks
+// containing the address, or 0.
+class network_set {
+private:
+    struct node {
+        uint8_t key[16] = {0}; // bits past prefix_len are zero
+        uint32_t prefix_len = 0;
+        uint32_t value = 0;
+        uint32_t child[2] = {0, 0};
+    };
+    std::vector<node> nodes; // node 0 is the root, covering ::/0
+    uint32_t make_node(const uint8_t *key, size_t prefix_len, uint32_t value);
+    static int bit(const uint8_t *key, size_t index) { return (key[index / 8] >> (7 - index % 8)) & 1; }
+    static size_t common_prefix(const uint8_t *a, const uint8_t *b, size_t limit);
+public:
+    network_set(): nodes(1) {}
+    void insert(const struct in6_addr &addr, size_t prefix_len, uint32_t value = 1);
+    bool insert(const std::string &network, uint32_t value = 1);
+    uint32_t find(const struct in6_addr &addr) const;
+    uint32_t find(const struct in_addr &addr) const;
+    uint32_t find(const std::string &address) const;
+    size_t size() const { return nodes.size() - 1; }
+    static void map(const struct in_addr &addr_v4, struct in6_addr &addr);
+    static bool parse(const std::string &address, struct in6_addr &addr, bool &ipv6);
+};
@@ -0,0 +1,192 @@
+#include <atomic>
+#include <stdio.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SharedTableFile "/var/tmp/me.qusic.skia.resolve"
+#define SharedTablePort "me.qusic.skia.resolve"
+
+// Name to fake address mapping shared by every injected process through a
+// memory mapped file owned by skiad. Slot i holds the name of fake address
+// index first_index() + i. Slots are only appended and never change once
+// published, and names are found through an open addressing table of slot
+// indexes, so lookups are lock-free. skiad is the only writer: injected
+// processes map the file read only and send names missing from it to skiad
+// through a message port.
+// Slots are never reclaimed one by one, as processes hand out names straight
+// from the mapping. Once the table is full skiad starts the next generation,
+// an empty table in a new file, which processes started from then on map.
+// Running ones keep the full one and put new names in their private rings.
+// Generations take turns over generation_count ranges of addresses, so a
+// process still on an older generation disagrees with newer ones only after
+// that many turns.
+struct shared_table {
+    struct slot {
+        std::atomic<uint32_t> length; // 0 until the name is published
+        uint32_t hash;
+        char name[256]; // NUL terminated
+    };
+    static const int32_t publish_message = 0; // message id of names on SharedTablePort
+    static const uint32_t magic_value = 0x736b6961;
+    static const uint32_t slot_count = 1 << 16;
+    static const uint32_t bucket_count = slot_count * 2;
+    static const uint32_t generation_count = 4;
+    std::atomic<uint32_t> magic;
+    uint32_t capacity;
+    std::atomic<uint32_t> count;
+    uint32_t generation;
+    slot slots[slot_count];
+    std::atomic<uint32_t> buckets[bucket_count]; // slot + 1, 0 for none
+
+    static uint32_t hash(const char *name, size_t length) {
+        // FNV-1a
+        uint64_t value = 14695981039346656037ULL;
+        for (size_t i = 0; i < length; i++) {
+            value = (value ^ static_cast<uint8_t>(name[i])) * 1099511628211ULL;
+        }
+        return static_cast<uint32_t>(value ^ (value >> 32));
+    }
+
+    // Name of a published slot, NULL for a slot out of range or not
+    // published yet.
+    const char *name_at(uint32_t index, uint32_t &length) const {
+        if (index >= slot_count || index >= count.load(std::memory_order_acquire)) {
+            return NULL;
+        }
+        const slot &s = slots[index];
+        length = s.length.load(std::memory_order_acquire);
+        if (length == 0 || length >= sizeof(s.name) || s.name[length] != '\0') {
+            return NULL;
+        }
+        return s.name;
+    }
+
+    // Slot of a name, slot_count when it is not published.
+    uint32_t find(const char *name, size_t length, uint32_t value) const {
+        uint32_t mask = bucket_count - 1;
+        for (uint32_t bucket = value & mask, probes = 0; probes < bucket_count; bucket = (bucket + 1) & mask, probes++) {
+            uint32_t entry = buckets[bucket].load(std::memory_order_acquire);
+            if (entry == 0) {
+                break;
+            }
+            uint32_t slot_length;
+            const char *slot_name = name_at(entry - 1, slot_length);
+            if (slot_name != NULL && slots[entry - 1].hash == value && slot_length == length && memcmp(slot_name, name, length) == 0) {
+                return entry - 1;
+            }
+        }
+        return slot_count;
+    }
+
+    // Fake address index of the first slot.
+    uint32_t first_index() const {
+        return generation % generation_count * slot_count;
+    }
+
+    bool full() const {
+        return count.load(std::memory_order_acquire) >= slot_count;
+    }
+
+    // Only called by skiad, one name at a time. Returns the slot of the name,
+    // slot_count when it cannot be published.
+    uint32_t publish(const char *name, size_t length) {
+        if (length == 0 || length >= sizeof(slot::name) || memchr(name, '\0', length) != NULL) {
+            return slot_count;
+        }
+        uint32_t value = hash(name, length);
+        uint32_t index = find(name, length, value);
+        uint32_t current_count = count.load(std::memory_order_relaxed);
+        if (index != slot_count || current_count >= slot_count) {
+            return index;
+        }
+        uint32_t mask = bucket_count - 1;
+        uint32_t bucket = value & mask;
+        while (buckets[bucket].load(std::memory_order_relaxed) != 0) {
+            bucket = (bucket + 1) & mask;
+        }
+        // publish the name before its slot becomes reachable from a bucket
+        slot &s = slots[current_count];
+        s.hash = value;
+        memcpy(s.name, name, length);
+        s.name[length] = '\0';
+        s.length.store(static_cast<uint32_t>(length), std::memory_order_release);
+        count.store(current_count + 1, std::memory_order_release);
+        buckets[bucket].store(current_count + 1, std::memory_order_release);
+        return current_count;
+    }
+
+    // Builds an empty table of the given generation and moves it in place
+    // with rename once its header is written. Only called by skiad.
+    static shared_table *create(uint32_t generation) {
+        const char *new_file = SharedTableFile ".new";
+        unlink(new_file);
+        int fd = open(new_file, O_RDWR | O_CREAT | O_EXCL, 0644);
+        if (fd == -1) {
+            return NULL;
+        }
+        if (fchmod(fd, 0644) != 0 || ftruncate(fd, sizeof(shared_table)) != 0) {
+            close(fd);
+            unlink(new_file);
+            return NULL;
+        }
+        void *memory = mmap(NULL, sizeof(shared_table), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (memory == MAP_FAILED) {
+            unlink(new_file);
+            return NULL;
+        }
+        shared_table *table = reinterpret_cast<shared_table *>(memory);
+        table->capacity = slot_count;
+        table->generation = generation;
+        table->magic.store(magic_value, std::memory_order_release);
+        if (rename(new_file, SharedTableFile) != 0) {
+            munmap(memory, sizeof(shared_table));
+            unlink(new_file);
+            return NULL;
+        }
+        return table;
+    }
+
+    // skiad keeps a valid file it owns that is not full and otherwise starts
+    // the next generation, so a file mapped by running processes is never
+    // resized or reused under them. They keep the old one until they restart.
+    // Injected processes only map an existing valid file that only its owner
+    // can write.
+    static shared_table *map(bool create) {
+        int fd = open(SharedTableFile, create ? O_RDWR : O_RDONLY);
+        struct stat file_stat;
+        if (fd != -1 && fstat(fd, &file_stat) != 0) {
+            close(fd);
+            fd = -1;
+        }
+        if (fd != -1 && (file_stat.st_size != sizeof(shared_table) || (file_stat.st_mode & 022) != 0 || (create && file_stat.st_uid != geteuid()))) {
+            close(fd);
+            fd = -1;
+        }
+        if (fd == -1) {
+            return create ? shared_table::create(0) : NULL;
+        }
+        if (create) {
+            uint32_t header[4] = {0, 0, 0, 0};
+            bool valid = pread(fd, header, sizeof(header), 0) == sizeof(header) && header[0] == magic_value && header[1] == slot_count;
+            if (!valid || header[2] >= slot_count) {
+                close(fd);
+                return shared_table::create(valid ? header[3] + 1 : 0);
+            }
+        }
+        void *memory = mmap(NULL, sizeof(shared_table), create ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (memory == MAP_FAILED) {
+            return NULL;
+        }
+        shared_table *table = reinterpret_cast<shared_table *>(memory);
+        if (table->magic.load(std::memory_order_acquire) != magic_value || table->capacity != slot_count) {
+            munmap(memory, sizeof(shared_table));
+            return NULL;
+        }
+        return table;
+    }
+};
@@ -1,4 +1,33 @@
 #include "skia.hpp"
+#include <algorithm>
+#include <new>
+#include <thread>
+#include <stddef.h>
+
+static void parse_timeouts(JSContextRef context, JSValueRef value, proxy_timeouts &timeouts);
+static void parse_logging(JSContextRef context, JSValueRef value);
+static JSValueRef get_property(JSContextRef context, JSObjectRef object, const char *name);
+
+skia::skia(): application(current_application()), application_string(JSStringCreateWithUTF8CString(application.c_str())), decision_cache(4096), proxy_config(script_context_count), stats(application) {
+    for (const char *network : {
+        "127.0.0.0/8", // loopback
+        "10.0.0.0/8", // private network
+        "172.16.0.0/12", // private network
+        "192.168.0.0/16", // private network
+        "100.64.0.0/10", // carrier-grade nat
+        "169.254.0.0/16", // link local
+        "::1/128", // loopback
+        "fc00::/7", // unique local
+        "fe80::/10", // link local
+    }) {
+        bypass_networks.insert(network);
+    }
+    proxy_config.execute([&](JSGlobalContextRef context) {
+        native_rules.compile(context, application);
+        parse_timeouts(context, get_property(context, JSContextGetGlobalObject(context), "timeouts"), default_timeouts);
+        parse_logging(context, get_property(context, JSContextGetGlobalObject(context), "logging"));
+    });
+}
 
 skia &skia::instance() {
     static skia instance;
@@ -7,53 +36,281 @@ skia &skia::instance() {
 
 std::string skia::current_application() {
     CFStringRef bundle_id = CFBundleGetIdentifier(CFBundleGetMainBundle());
-    return bundle_id ? CFStringGetCStringPtr(bundle_id, CFStringGetSystemEncoding()) : getprogname();
+    if (bundle_id == NULL) {
+        return getprogname();
+    }
+    // the fast path only works when the string happens to be stored in UTF-8
+    const char *bundle_id_ptr = CFStringGetCStringPtr(bundle_id, kCFStringEncodingUTF8);
+    if (bundle_id_ptr != NULL) {
+        return bundle_id_ptr;
+    }
+    char buffer[256];
+    return CFStringGetCString(bundle_id, buffer, sizeof(buffer), kCFStringEncodingUTF8) ? buffer : getprogname();
+}
+
+const skia::script_values *skia::prepare_context(JSGlobalContextRef context) {
+    for (script_values &values : context_values) {
+        JSGlobalContextRef owner = values.context.load(std::memory_order_acquire);
+        if (owner == NULL && values.context.compare_exchange_strong(owner, context, std::memory_order_acq_rel)) {
+            values.query_function = JSValueToObject(context, get_property(context, JSContextGetGlobalObject(context), "__skia_queryProxy"), NULL);
+            values.application = JSValueMakeString(context, application_string);
+            if (values.query_function != NULL) {
+                JSValueProtect(context, values.query_function);
+            }
+            JSValueProtect(context, values.application);
+            return &values;
+        }
+        if (owner == context) {
+            return &values;
+        }
+    }
+    return NULL; // not reached, there is a slot for every context of the pool
+}
+
+static JSValueRef get_property(JSContextRef context, JSObjectRef object, JSStringRef name) {
+    return JSObjectGetProperty(context, object, name, NULL);
+}
+
+static JSValueRef get_property(JSContextRef context, JSObjectRef object, const char *name) {
+    JSStringRef property = JSStringCreateWithUTF8CString(name);
+    JSValueRef value = get_property(context, object, property);
+    JSStringRelease(property);
+    return value;
+}
+
+// Names of the properties read from the result of every decision, created
+// once and kept for the life of the process.
+struct result_properties {
+    JSStringRef proxies = JSStringCreateWithUTF8CString("proxies");
+    JSStringRef length = JSStringCreateWithUTF8CString("length");
+    JSStringRef race = JSStringCreateWithUTF8CString("race");
+    JSStringRef no_cache = JSStringCreateWithUTF8CString("noCache");
+    JSStringRef ttl = JSStringCreateWithUTF8CString("ttl");
+    JSStringRef host = JSStringCreateWithUTF8CString("host");
+    JSStringRef port = JSStringCreateWithUTF8CString("port");
+    JSStringRef optimistic = JSStringCreateWithUTF8CString("optimistic");
+    JSStringRef timeouts = JSStringCreateWithUTF8CString("timeouts");
+    JSStringRef phases[phase_count] = {JSStringCreateWithUTF8CString("connect"), JSStringCreateWithUTF8CString("greeting"), JSStringCreateWithUTF8CString("reply")};
+    JSStringRef adaptive = JSStringCreateWithUTF8CString("adaptive");
+    static const result_properties &names() {
+        static const result_properties names;
+        return names;
+    }
+};
+
+static std::vector<std::string> get_strings(JSContextRef context, JSObjectRef object, const char *name) {
+    std::vector<std::string> strings;
+    JSObjectRef array = JSValueToObject(context, get_property(context, object, name), NULL);
+    if (array != NULL) {
+        size_t length = JSValueToNumber(context, get_property(context, array, "length"), NULL);
+        for (size_t i = 0; i < length; i++) {
+            strings.push_back(string_value(context, JSObjectGetPropertyAtIndex(context, array, static_cast<unsigned>(i), NULL)));
+        }
+    }
+    return strings;
+}
+
+static void parse_timeouts(JSContextRef context, JSValueRef value, proxy_timeouts &timeouts) {
+    JSObjectRef object = JSValueIsObject(context, value) ? JSValueToObject(context, value, NULL) : NULL;
+    if (object == NULL) {
+        return;
+    }
+    const result_properties &names = result_properties::names();
+    for (int phase = 0; phase < phase_count; phase++) {
+        double msec = JSValueToNumber(context, get_property(context, object, names.phases[phase]), NULL);
+        timeouts.msec[phase] = msec > 0 && msec < UINT32_MAX ? static_cast<uint32_t>(msec) : 0;
+    }
+    JSValueRef adaptive = get_property(context, object, names.adaptive);
+    if (JSValueIsBoolean(context, adaptive)) {
+        timeouts.adaptive = JSValueToBoolean(context, adaptive) ? 1 : 0;
+    }
 }
 
-socket_address skia::query_proxy(const std::string &target_name, const uint16_t &target_port, bool &no_cache) {
-    socket_address proxy;
+static void parse_logging(JSContextRef context, JSValueRef value) {
+    JSObjectRef object = JSValueIsObject(context, value) ? JSValueToObject(context, value, NULL) : NULL;
+    if (object == NULL) {
+        return;
+    }
+    JSValueRef level = get_property(context, object, "level");
+    if (JSValueIsString(context, level)) {
+        std::string name = string_value(context, level);
+        if (name == "error") {
+            logger::level = LOG_ERR;
+        } else if (name == "notice") {
+            logger::level = LOG_NOTICE;
+        } else if (name == "info") {
+            logger::level = LOG_INFO;
+        }
+    }
+    JSValueRef sample = get_property(context, object, "sample");
+    if (JSValueIsNumber(context, sample)) {
+        double every = JSValueToNumber(context, sample, NULL);
+        logger::sample = every >= 1 && every < UINT32_MAX ? static_cast<uint32_t>(every) : 1;
+    }
+    JSValueRef rate = get_property(context, object, "rate");
+    if (JSValueIsNumber(context, rate)) {
+        double limit = JSValueToNumber(context, rate, NULL);
+        logger::rate = limit >= 1 && limit < UINT32_MAX ? static_cast<uint32_t>(limit) : 0;
+    }
+}
+
+static bool parse_proxy(JSContextRef context, JSValueRef value, proxy_address &proxy) {
+    proxy = proxy_address();
+    JSObjectRef object = JSValueIsObject(context, value) ? JSValueToObject(context, value, NULL) : NULL;
+    if (object == NULL) {
+        return JSValueIsNull(context, value) || string_value(context, value) == "DIRECT";
+    }
+    const result_properties &names = result_properties::names();
+    JSStringRef host_string = JSValueToStringCopy(context, get_property(context, object, names.host), NULL);
+    char host_buffer[INET6_ADDRSTRLEN];
+    JSStringGetUTF8CString(host_string, host_buffer, sizeof(host_buffer));
+    JSStringRelease(host_string);
+    uint16_t port_number = JSValueToNumber(context, get_property(context, object, names.port), NULL);
+    if (inet_aton(host_buffer, reinterpret_cast<struct in_addr *>(&proxy.addr)) == 1) {
+        proxy.port = htons(port_number);
+        proxy.optimistic = JSValueToBoolean(context, get_property(context, object, names.optimistic));
+        parse_timeouts(context, get_property(context, object, names.timeouts), proxy.timeouts);
+    } else {
+        proxy.addr = 0;
+        proxy.port = 0;
+    }
+    return true;
+}
+
+static void parse_result(JSContextRef context, JSValueRef result, proxy_list &proxies, bool &no_cache, uint32_t &ttl) {
+    proxies = proxy_list();
+    JSObjectRef result_object = JSValueIsObject(context, result) ? JSValueToObject(context, result, NULL) : NULL;
+    if (result_object == NULL) {
+        return;
+    }
+    // a single proxy, an array of proxies, or an object holding the array
+    const result_properties &names = result_properties::names();
+    JSValueRef list_value = get_property(context, result_object, names.proxies);
+    JSObjectRef list_object = JSValueIsObject(context, list_value) ? JSValueToObject(context, list_value, NULL) : NULL;
+    if (list_object == NULL && JSValueIsNumber(context, get_property(context, result_object, names.length))) {
+        list_object = result_object;
+    }
+    if (list_object != NULL) {
+        size_t length = JSValueToNumber(context, get_property(context, list_object, names.length), NULL);
+        for (size_t i = 0; i < length; i++) {
+            proxy_address proxy;
+            if (parse_proxy(context, JSObjectGetPropertyAtIndex(context, list_object, static_cast<unsigned>(i), NULL), proxy) && !proxies.push(proxy)) {
+                break;
+            }
+        }
+        proxies.race = JSValueToBoolean(context, get_property(context, result_object, names.race));
+    } else {
+        proxy_address proxy;
+        if (parse_proxy(context, result_object, proxy) && proxy.addr != 0) {
+            proxies.push(proxy);
+        }
+    }
+    if (proxies.count == 1 && proxies.proxies[0].addr == 0) {
+        proxies.count = 0;
+    }
+    no_cache = JSValueToBoolean(context, get_property(context, result_object, names.no_cache));
+    double ttl_number = JSValueToNumber(context, get_property(context, result_object, names.ttl), NULL);
+    ttl = ttl_number > 0 && ttl_number < UINT32_MAX ? static_cast<uint32_t>(ttl_number) : 0;
+}
+
+void proxy_rules::compile(JSContextRef context, const std::string &application) {
+    rules.clear();
+    JSValueRef rules_value = get_property(context, JSContextGetGlobalObject(context), "rules");
+    if (!JSValueIsObject(context, rules_value)) {
+        return;
+    }
+    JSObjectRef rules_array = JSValueToObject(context, rules_value, NULL);
+    size_t length = JSValueToNumber(context, get_property(context, rules_array, "length"), NULL);
+    for (size_t i = 0; i < length; i++) {
+        JSObjectRef rule_object = JSValueToObject(context, JSObjectGetPropertyAtIndex(context, rules_array, static_cast<unsigned>(i), NULL), NULL);
+        if (rule_object == NULL) {
+            continue;
+        }
+        std::vector<std::string> apps = get_strings(context, rule_object, "apps");
+        if (!apps.empty()) {
+            // the application never changes within a process, so app conditions are settled now
+            std::unordered_set<std::string> app_set(apps.begin(), apps.end());
+            if (app_set.find(application) == app_set.end()) {
+                continue;
+            }
+        }
+        rules.push_back(rule());
+        rule &r = rules.back();
+        for (const std::string &domain : get_strings(context, rule_object, "domains")) {
+            r.domains.insert(domain);
+            r.has_domains = true;
+        }
+        for (const std::string &network : get_strings(context, rule_object, "networks")) {
+            if (r.networks.insert(network)) {
+                r.has_networks = true;
+            } else {
+                err("invalid network in rule %zu: %s", i, network.c_str());
+            }
+        }
+        for (const std::string &port : get_strings(context, rule_object, "ports")) {
+            r.ports.insert(static_cast<uint16_t>(atoi(port.c_str())));
+        }
+        r.script = JSValueToBoolean(context, get_property(context, rule_object, "script"));
+        parse_result(context, get_property(context, rule_object, "proxy"), r.proxies, r.no_cache, r.ttl);
+    }
+    log("compiled %zu rules for %s", rules.size(), application.c_str());
+}
+
+bool proxy_rules::evaluate(const std::string &target_name, uint16_t target_port, proxy_list &proxies, bool &no_cache, uint32_t &ttl) const {
+    if (rules.empty()) {
+        return false;
+    }
+    struct in6_addr target_addr;
+    bool target_ipv6;
+    bool target_numeric = network_set::parse(target_name, target_addr, target_ipv6);
+    for (const rule &r : rules) {
+        if (!r.ports.empty() && r.ports.find(target_port) == r.ports.end()) {
+            continue;
+        }
+        if (r.has_domains && (target_numeric || r.domains.find(target_name) == 0)) {
+            continue;
+        }
+        if (r.has_networks && (!target_numeric || r.networks.find(target_addr) == 0)) {
+            continue;
+        }
+        if (r.script) {
+            return false;
+        }
+        proxies = r.proxies;
+        no_cache = r.no_cache;
+        ttl = r.ttl;
+        return true;
+    }
+    return false;
+}
+
+proxy_list skia::query_proxy(const std::string &target_name, const uint16_t &target_port, bool &no_cache, uint32_t &ttl) {
+    proxy_list proxies;
+    if (native_rules.evaluate(target_name, target_port, proxies, no_cache, ttl)) {
+        stats.count(stats_table::decisions_rules);
+        return proxies;
+    }
+    stats.count(stats_table::decisions_script);
     bool no_cache_flag = false;
+    uint32_t ttl_value = 0;
     proxy_config.execute([&](JSGlobalContextRef context) {
-        JSStringRef query_function_name = JSStringCreateWithUTF8CString("__skia_queryProxy");
-        JSObjectRef query_function = JSValueToObject(context, JSObjectGetProperty(context, JSContextGetGlobalObject(context), query_function_name, NULL), NULL);
-        JSStringRelease(query_function_name);
-        if (query_function == NULL) {
+        const script_values *values = prepare_context(context);
+        if (values == NULL || values->query_function == NULL) {
             return;
         }
-        JSStringRef application_string = JSStringCreateWithUTF8CString(current_application().c_str());
         JSStringRef target_name_string = JSStringCreateWithUTF8CString(target_name.c_str());
         JSValueRef arguments[] = {
-            JSValueMakeString(context, application_string),
+            values->application,
             JSValueMakeString(context, target_name_string),
             JSValueMakeNumber(context, target_port),
         };
-        JSStringRelease(application_string);
         JSStringRelease(target_name_string);
-        JSObjectRef result_object = JSValueToObject(context, JSObjectCallAsFunction(context, query_function, NULL, sizeof(arguments) / sizeof(arguments[0]), arguments, NULL), NULL);
-        if (result_object == NULL) {
-            return;
-        }
-        JSStringRef host_property = JSStringCreateWithUTF8CString("host");
-        JSStringRef port_property = JSStringCreateWithUTF8CString("port");
-        JSStringRef no_cache_property = JSStringCreateWithUTF8CString("noCache");
-        JSStringRef host_string = JSValueToStringCopy(context, JSObjectGetProperty(context, result_object, host_property, NULL), NULL);
-        char host_buffer[INET6_ADDRSTRLEN];
-        JSStringGetUTF8CString(host_string, host_buffer, sizeof(host_buffer));
-        JSStringRelease(host_string);
-        uint16_t port_number = JSValueToNumber(context, JSObjectGetProperty(context, result_object, port_property, NULL), NULL);
-        no_cache_flag = JSValueToBoolean(context, JSObjectGetProperty(context, result_object, no_cache_property, NULL));
-        JSStringRelease(host_property);
-        JSStringRelease(port_property);
-        JSStringRelease(no_cache_property);
-        if (inet_aton(host_buffer, reinterpret_cast<struct in_addr *>(&proxy.addr)) == 1) {
-            proxy.port = htons(port_number);
-        } else {
-            proxy.addr = 0;
-            proxy.port = 0;
-        }
+        JSValueRef result = JSObjectCallAsFunction(context, values->query_function, NULL, sizeof(arguments) / sizeof(arguments[0]), arguments, NULL);
+        parse_result(context, result, proxies, no_cache_flag, ttl_value);
     });
     no_cache = no_cache_flag;
-    return proxy;
+    ttl = ttl_value;
+    return proxies;
 }
 
 bool skia::should_bypass(const int &sock) {
@@ -80,16 +337,16 @@ bool skia::should_bypass(const struct sockaddr *addr) {
 }
 
 bool skia::should_bypass(const struct in6_addr &target_addr, const in_port_t &target_port, bool ipv6) {
+    if (resolve_table::instance().is_resolved_addr(target_addr, ipv6)) {
+        return false; // the ipv6 pool lies inside fc00::/7
+    }
     if (ipv6) {
+        return bypass_networks.find(target_addr) != 0;
     } else {
-        in_addr_t target_addr_v4 = target_addr.__u6_addr.__u6_addr32[0];
-        for (const socket_network &bypass_network : bypass_networks) {
-            if ((target_addr_v4 & bypass_network.mask) == (bypass_network.addr & bypass_network.mask) && (bypass_network.port == 0 || target_port == bypass_network.port)) {
-                return true;
-            }
-        }
+        struct in_addr target_addr_v4;
+        target_addr_v4.s_addr = target_addr.__u6_addr.__u6_addr32[0];
+        return bypass_networks.find(target_addr_v4) != 0;
     }
-    return false;
 }
 
 bool skia::should_bypass(const std::string &target_name, const std::string &target_serv) {
@@ -108,7 +365,10 @@ bool skia::should_bypass(const std::string &target_name, const std::string &targ
     return false;
 }
 
-void skia::extract_target(const struct sockaddr *addr, struct in6_addr &target_addr, in_port_t &target_port, bool &ipv6) {
+void skia::extract_target(const struct sockaddr *addr, connect_target &target) {
+    struct in6_addr &target_addr = target.addr;
+    in_port_t &target_port = target.port;
+    bool &ipv6 = target.ipv6;
     ipv6 = addr->sa_family == AF_INET6;
     if (ipv6) {
         const struct sockaddr_in6 *address_in = reinterpret_cast<const struct sockaddr_in6 *>(addr);
@@ -126,90 +386,523 @@ void skia::extract_target(const struct sockaddr *addr, struct in6_addr &target_a
         memcpy(&target_addr, in_addr, sizeof(struct in_addr));
         target_port = address_in->sin_port;
     }
+    target.resolved = resolve_table::instance().is_resolved_addr(target_addr, ipv6);
+    if (target.resolved) {
+        target.name = resolve_table::instance().addr_to_name(target_addr, ipv6);
+    }
 }
 
-socket_address skia::query_proxy(const std::string &target_name, const uint16_t &target_port) {
-    socket_address proxy;
-    if (target_name.length() == 0 || target_port == 0) {
-        return proxy;
-    }
-    std::string key = target_name + ":" + std::to_string(target_port);
-    mutex.lock_shared();
-    auto entry = proxy_cache.find(key);
-    if (entry != proxy_cache.end()) {
-        proxy = entry->second;
-        mutex.unlock_shared();
+// Looks the decision up by key, and only on a miss asks for the target name
+// to evaluate it, so a hit touches nothing but the cache.
+template <typename Name>
+proxy_list skia::query_proxy(const char *key, size_t key_len, uint32_t key_hash, uint16_t target_port, Name target_name) {
+    proxy_list proxies;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if (decision_cache.find(key, key_len, key_hash, target_port, proxies)) {
+        stats.count(stats_table::decisions_cached);
+        stats.sample(stats_table::decision_cached_usec, static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count()));
     } else {
-        mutex.unlock_shared();
         bool no_cache = false;
-        proxy = query_proxy(target_name, target_port, no_cache);
-        if (!no_cache) {
-            mutex.lock();
-            proxy_cache[key] = proxy;
-            mutex.unlock();
+        uint32_t ttl = 0;
+        proxies = query_proxy(target_name(), target_port, no_cache, ttl);
+        if (!no_cache && decision_cache.insert(key, key_len, key_hash, target_port, proxies, ttl)) {
+            stats.count(stats_table::decisions_evicted);
         }
+        stats.sample(stats_table::decision_evaluated_usec, static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count()));
     }
-    return proxy;
+    return health.filter(proxies);
 }
 
-socket_address skia::query_proxy(const struct in6_addr &target_addr, const in_port_t &target_port, bool ipv6) {
-    std::string target_name;
-    if (!ipv6 && resolve_table::instance().is_resolved_addr(target_addr.__u6_addr.__u6_addr32[0])) {
-        target_name = resolve_table::instance().addr_to_name(target_addr.__u6_addr.__u6_addr32[0]);
-    } else {
-        char target_name_buffer[INET6_ADDRSTRLEN];
-        target_name = inet_ntop(ipv6 ? AF_INET6 : AF_INET, &target_addr, target_name_buffer, sizeof(target_name_buffer));
+// Literal addresses are keyed by their bytes behind a nul, which no name
+// contains, whether they come in as a sockaddr or as text, so one target has
+// one cache entry.
+static size_t literal_key(char *key, const struct in6_addr &addr, bool ipv6) {
+    size_t key_len = 1 + (ipv6 ? sizeof(struct in6_addr) : sizeof(struct in_addr));
+    key[0] = '\0';
+    memcpy(key + 1, &addr, key_len - 1);
+    return key_len;
+}
+
+proxy_list skia::query_proxy(const std::string &target_name, const uint16_t &target_port) {
+    if (target_name.length() == 0 || target_port == 0) {
+        return proxy_list();
+    }
+    auto name = [&]() -> const std::string & {
+        return target_name;
+    };
+    struct in6_addr target_addr;
+    bool ipv6 = target_name.find(':') != std::string::npos;
+    if (inet_pton(ipv6 ? AF_INET6 : AF_INET, target_name.c_str(), &target_addr) == 1) {
+        if (ipv6 && IN6_IS_ADDR_V4MAPPED(&target_addr)) {
+            // as extract_target does
+            memmove(&target_addr, target_addr.s6_addr + 12, sizeof(struct in_addr));
+            ipv6 = false;
+        }
+        char key[1 + sizeof(struct in6_addr)];
+        size_t key_len = literal_key(key, target_addr, ipv6);
+        return query_proxy(key, key_len, resolve_table::hash(key, key_len), target_port, name);
+    }
+    return query_proxy(target_name.data(), target_name.length(), resolve_table::hash(target_name.data(), target_name.length()), target_port, name);
+}
+
+proxy_list skia::query_proxy(const connect_target &target) {
+    const struct in6_addr &target_addr = target.addr;
+    bool ipv6 = target.ipv6;
+    if (target.resolved) {
+        // keyed by the name the target already holds
+        if (target.name.empty() || target.port == 0) {
+            return proxy_list();
+        }
+        return query_proxy(target.name.c_str(), target.name.length(), target.name.hash(), ntohs(target.port), [&]() {
+            return target.name.str();
+        });
+    }
+    if (target.port == 0) {
+        return proxy_list();
     }
-    return query_proxy(target_name, ntohs(target_port));
+    // only formatted when the decision is not cached
+    char key[1 + sizeof(struct in6_addr)];
+    size_t key_len = literal_key(key, target_addr, ipv6);
+    return query_proxy(key, key_len, resolve_table::hash(key, key_len), ntohs(target.port), [&]() {
+        char target_name[INET6_ADDRSTRLEN];
+        return std::string(inet_ntop(ipv6 ? AF_INET6 : AF_INET, &target_addr, target_name, sizeof(target_name)));
+    });
+}
+
+void proxy_health::failed(const socket_address &proxy) {
+    std::lock_guard<std::mutex> lock(mutex);
+    failures[key(proxy)] = std::chrono::steady_clock::now() + std::chrono::seconds(penalty_sec);
+    failure_count.store(failures.size(), std::memory_order_relaxed);
+}
+
+void proxy_health::succeeded(const socket_address &proxy) {
+    if (failure_count.load(std::memory_order_relaxed) == 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    failures.erase(key(proxy));
+    failure_count.store(failures.size(), std::memory_order_relaxed);
+}
+
+proxy_list proxy_health::filter(const proxy_list &proxies) {
+    if (failure_count.load(std::memory_order_relaxed) == 0 || proxies.direct()) {
+        return proxies;
+    }
+    proxy_list result;
+    result.race = proxies.race;
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(mutex);
+    for (size_t i = 0; i < proxies.count; i++) {
+        const proxy_address &proxy = proxies.proxies[i];
+        auto entry = proxy.addr != 0 ? failures.find(key(proxy)) : failures.end();
+        if (entry != failures.end() && entry->second <= now) {
+            failures.erase(entry);
+            entry = failures.end();
+        }
+        if (entry == failures.end()) {
+            result.push(proxy);
+        }
+    }
+    failure_count.store(failures.size(), std::memory_order_relaxed);
+    return result.count > 0 ? result : proxies;
 }
 
+void proxy_health::observed(const socket_address &proxy, proxy_phase phase, uint32_t usec) {
+    latency_shard &s = shard(key(proxy));
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    if (s.latencies.size() >= shard_capacity && s.latencies.find(key(proxy)) == s.latencies.end()) {
+        // a full shard makes room by dropping the proxy observed least
+        // recently, keeping the samples of the ones in use
+        auto stalest = s.latencies.begin();
+        for (auto entry = s.latencies.begin(); entry != s.latencies.end(); ++entry) {
+            if (entry->second.updated < stalest->second.updated) {
+                stalest = entry;
+            }
+        }
+        s.latencies.erase(stalest);
+    }
+    latency &l = s.latencies[key(proxy)];
+    l.samples[phase][l.count[phase]++ % latency::sample_count] = usec;
+    l.backoff[phase] = 0;
+    l.updated = now;
+}
+
+// A phase that timed out doubles its next limit until it completes again, as
+// it adds no sample, so a proxy that slowed down is not locked out by limits
+// derived from its faster past.
+void proxy_health::expired(const socket_address &proxy, proxy_phase phase) {
+    latency_shard &s = shard(key(proxy));
+    std::lock_guard<std::mutex> lock(s.mutex);
+    auto entry = s.latencies.find(key(proxy));
+    if (entry != s.latencies.end()) {
+        uint8_t &backoff = entry->second.backoff[phase];
+        backoff = std::min<uint8_t>(backoff + 1, adaptive_max_backoff);
+        entry->second.updated = std::chrono::steady_clock::now();
+    }
+}
+
+uint32_t proxy_health::adaptive_timeout(const socket_address &proxy, proxy_phase phase, uint32_t limit_msec) {
+    uint32_t samples[latency::sample_count];
+    size_t count = 0;
+    uint8_t backoff = 0;
+    {
+        latency_shard &s = shard(key(proxy));
+        std::lock_guard<std::mutex> lock(s.mutex);
+        auto entry = s.latencies.find(key(proxy));
+        if (entry == s.latencies.end()) {
+            return limit_msec;
+        }
+        count = std::min(entry->second.count[phase], latency::sample_count);
+        std::copy(entry->second.samples[phase], entry->second.samples[phase] + count, samples);
+        backoff = entry->second.backoff[phase];
+    }
+    if (count < adaptive_min_samples) {
+        return limit_msec;
+    }
+    // four times the 95th percentile leaves room for jitter while still
+    // giving up on a stalled proxy long before the configured limit
+    uint32_t *percentile = samples + count * 95 / 100;
+    std::nth_element(samples, percentile, samples + count);
+    uint64_t msec = std::max<uint64_t>(static_cast<uint64_t>(*percentile) * 4 / 1000, adaptive_min_msec) << backoff;
+    return static_cast<uint32_t>(std::min<uint64_t>(msec, limit_msec));
+}
+
+uint32_t skia::proxy_timeout(const proxy_address &proxy, proxy_phase phase) {
+    static const uint32_t default_msec = 10 * 1000;
+    uint32_t msec = proxy.timeouts.msec[phase] ?: default_timeouts.msec[phase] ?: default_msec;
+    bool adaptive = proxy.timeouts.adaptive != -1 ? proxy.timeouts.adaptive == 1 : default_timeouts.adaptive == 1;
+    return adaptive ? health.adaptive_timeout(proxy, phase, msec) : msec;
+}
+
+daemon_messages &daemon_messages::instance() {
+    // never destroyed, as its thread may still be sending at exit
+    static daemon_messages *instance = new daemon_messages();
+    return *instance;
+}
+
+void daemon_messages::send(int32_t message, const void *data, size_t length) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (queue.size() >= max_queued) {
+        return;
+    }
+    queue.push_back(std::make_pair(message, std::string(reinterpret_cast<const char *>(data), length)));
+    if (!started) {
+        started = true;
+        std::thread(&daemon_messages::run, this).detach();
+    }
+    ready.notify_one();
+}
+
+void daemon_messages::run() {
+    CFMessagePortRef port = NULL;
+    while (true) {
+        std::pair<int32_t, std::string> message;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            ready.wait(lock, [this]() { return !queue.empty(); });
+            message = std::move(queue.front());
+            queue.pop_front();
+        }
+        if (port != NULL && !CFMessagePortIsValid(port)) {
+            CFRelease(port);
+            port = NULL;
+        }
+        if (port == NULL) {
+            port = CFMessagePortCreateRemote(kCFAllocatorDefault, CFSTR(SharedTablePort));
+        }
+        if (port == NULL) {
+            continue;
+        }
+        CFDataRef data = CFDataCreateWithBytesNoCopy(kCFAllocatorDefault, reinterpret_cast<const UInt8 *>(message.second.data()), message.second.length(), kCFAllocatorNull);
+        CFMessagePortSendRequest(port, message.first, data, send_timeout, 0, NULL, NULL);
+        CFRelease(data);
+    }
+}
+
+metrics::metrics(const std::string &application): pending(), next_flush(0) {
+    strlcpy(pending.name, application.c_str(), sizeof(pending.name));
+    pthread_key_create(&key, release_block);
+}
+
+metrics::block *metrics::thread_block() {
+    block *b = reinterpret_cast<block *>(pthread_getspecific(key));
+    if (b == NULL) {
+        b = new block(); // value initialized, so counters start at zero
+        b->owner = this;
+        std::lock_guard<std::mutex> lock(blocks_mutex);
+        blocks.push_back(b);
+        pthread_setspecific(key, b);
+    }
+    return b;
+}
+
+void metrics::release_block(void *data) {
+    block *b = reinterpret_cast<block *>(data);
+    metrics *owner = b->owner;
+    std::lock_guard<std::mutex> lock(owner->blocks_mutex);
+    owner->collect(b);
+    owner->blocks.erase(std::remove(owner->blocks.begin(), owner->blocks.end(), b), owner->blocks.end());
+    delete b;
+}
+
+void metrics::collect(block *b) {
+    for (size_t i = 0; i < stats_table::counter_count; i++) {
+        pending.counters[i] += b->counters[i].exchange(0, std::memory_order_relaxed);
+    }
+    for (size_t i = 0; i < stats_table::histogram_count; i++) {
+        for (size_t j = 0; j < stats_table::bucket_count; j++) {
+            pending.histograms[i][j] += b->histograms[i][j].exchange(0, std::memory_order_relaxed);
+        }
+    }
+}
+
+void metrics::maybe_flush() {
+    int64_t now = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    int64_t due = next_flush.load(std::memory_order_relaxed);
+    if (now < due || !next_flush.compare_exchange_strong(due, now + flush_sec, std::memory_order_relaxed)) {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(blocks_mutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        return;
+    }
+    for (block *b : blocks) {
+        collect(b);
+    }
+    std::string message(reinterpret_cast<const char *>(&pending), sizeof(pending));
+    memset(pending.counters, 0, sizeof(pending.counters));
+    memset(pending.histograms, 0, sizeof(pending.histograms));
+    lock.unlock();
+    {
+        std::lock_guard<std::mutex> proxies_lock(proxies_mutex);
+        for (const auto &entry : proxies) {
+            message.append(reinterpret_cast<const char *>(&entry.second), sizeof(entry.second));
+        }
+        proxies.clear();
+    }
+    daemon_messages::instance().send(stats_table::report_message, message.data(), message.length());
+}
+
+void metrics::count(stats_table::counter counter) {
+    thread_block()->counters[counter].fetch_add(1, std::memory_order_relaxed);
+    maybe_flush();
+}
+
+void metrics::sample(stats_table::histogram histogram, uint32_t usec) {
+    thread_block()->histograms[histogram][stats_table::bucket(usec)].fetch_add(1, std::memory_order_relaxed);
+    maybe_flush();
+}
+
+// Called with proxies_mutex held. Returns NULL once a report holds as many
+// proxies as skiad accepts.
+stats_table::proxy_report *metrics::proxy_report(const socket_address &proxy) {
+    uint64_t proxy_key = static_cast<uint64_t>(proxy.addr) << 16 | proxy.port;
+    auto entry = proxies.find(proxy_key);
+    if (entry == proxies.end()) {
+        if (proxies.size() >= stats_table::proxy_count) {
+            return NULL;
+        }
+        stats_table::proxy_report r = {};
+        r.addr = proxy.addr;
+        r.port = proxy.port;
+        entry = proxies.insert(std::make_pair(proxy_key, r)).first;
+    }
+    return &entry->second;
+}
+
+void metrics::proxy_count(const socket_address &proxy, int counter) {
+    if (counter < 0 || counter >= stats_table::proxy_counter_count) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(proxies_mutex);
+        stats_table::proxy_report *r = proxy_report(proxy);
+        if (r != NULL) {
+            r->counters[counter]++;
+        }
+    }
+    maybe_flush();
+}
+
+void metrics::proxy_sample(const socket_address &proxy, stats_table::proxy_histogram histogram, uint32_t usec) {
+    {
+        std::lock_guard<std::mutex> lock(proxies_mutex);
+        stats_table::proxy_report *r = proxy_report(proxy);
+        if (r != NULL) {
+            r->histograms[histogram][stats_table::bucket(usec)]++;
+        }
+    }
+    maybe_flush();
+}
+
+const uint8_t resolve_table::addr6_prefix[12] = {0xfd, 0x73, 0x6b, 0x69, 0x61, 0x00};
+
 resolve_table &resolve_table::instance() {
     static resolve_table instance;
     return instance;
 }
 
-size_t resolve_table::make_index(const std::string &name) {
-    size_t result = 0;
+resolve_table::name_entry *resolve_table::make_entry(const std::string &name, uint32_t hash) {
+    name_entry *entry = new (::operator new(offsetof(name_entry, name) + name.length() + 1)) name_entry;
+    entry->refs.store(1, std::memory_order_relaxed);
+    entry->length = static_cast<uint32_t>(name.length());
+    entry->hash = hash;
+    memcpy(entry->name, name.c_str(), name.length() + 1);
+    return entry;
+}
+
+void resolve_table::release(name_entry *entry) {
+    if (entry != NULL && entry->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        ::operator delete(entry);
+    }
+}
+
+size_t resolve_table::find_index(const std::string &name, uint32_t hash) {
+    for (uint32_t next = buckets[hash & (buckets.size() - 1)]; next != 0; ) {
+        slot &s = slot_at(next - 1);
+        const name_entry *entry = s.name.load(std::memory_order_relaxed);
+        if (entry->hash == hash && entry->length == name.length() && memcmp(entry->name, name.data(), name.length()) == 0) {
+            s.referenced.store(true, std::memory_order_relaxed);
+            return next - 1;
+        }
+        next = s.next;
+    }
+    return addr_count;
+}
+
+void resolve_table::unlink(size_t index) {
+    slot &s = slot_at(index);
+    uint32_t *link = &buckets[s.name.load(std::memory_order_relaxed)->hash & (buckets.size() - 1)];
+    while (*link != 0 && *link != index + 1) {
+        link = &slot_at(*link - 1).next;
+    }
+    if (*link != 0) {
+        *link = s.next;
+    }
+    s.next = 0;
+}
+
+void resolve_table::link(size_t index) {
+    slot &s = slot_at(index);
+    uint32_t &bucket = buckets[s.name.load(std::memory_order_relaxed)->hash & (buckets.size() - 1)];
+    s.next = bucket;
+    bucket = static_cast<uint32_t>(index + 1);
+}
+
+void resolve_table::assign(size_t index, const std::string &name, uint32_t hash) {
+    slot *chunk = chunks[index >> chunk_bits].load(std::memory_order_relaxed);
+    if (chunk == NULL) {
+        chunk = new slot[chunk_size];
+        chunks[index >> chunk_bits].store(chunk, std::memory_order_release);
+    }
+    slot &s = chunk[index & (chunk_size - 1)];
+    name_entry *old = s.name.exchange(make_entry(name, hash));
+    if (old != NULL) {
+        // a lookup that loaded the old name counts its reference right after
+        while (s.readers.load() != 0) {
+            std::this_thread::yield();
+        }
+        release(old);
+    }
+    s.referenced.store(false, std::memory_order_relaxed);
+    if (++linked > buckets.size()) {
+        std::vector<uint32_t>(buckets.size() * 2).swap(buckets);
+        for (size_t i = 0; i < chunk_count; i++) {
+            slot *c = chunks[i].load(std::memory_order_relaxed);
+            for (size_t j = 0; c != NULL && j < chunk_size; j++) {
+                if (c[j].name.load(std::memory_order_relaxed) != NULL) {
+                    link((i << chunk_bits) | j);
+                }
+            }
+        }
+    } else {
+        link(index);
+    }
+}
+
+size_t resolve_table::make_index(const std::string &name, uint32_t hash) {
     mutex.lock();
-    if (name_table.size() >= addr_count) {
-        for (auto entry = name_table.begin(); entry != name_table.end(); entry++) {
-            if (entry->second == index) {
-                name_table.erase(entry);
+    size_t result = find_index(name, hash);
+    if (result != addr_count) {
+        mutex.unlock();
+        return result;
+    }
+    size_t current_count = count.load(std::memory_order_relaxed);
+    bool recycled = current_count >= addr_count;
+    if (!recycled) {
+        result = current_count++;
+    } else {
+        // the hand marks the slot it takes, so a pin racing with it fails
+        while (true) {
+            slot &s = slot_at(hand);
+            uint32_t idle = 0;
+            if (s.pins.load(std::memory_order_relaxed) == 0 && !s.referenced.exchange(false, std::memory_order_relaxed) && s.pins.compare_exchange_strong(idle, recycling_pin, std::memory_order_acquire)) {
                 break;
             }
+            hand = hand + 1 < addr_count ? hand + 1 : first_private;
         }
+        result = hand;
+        hand = hand + 1 < addr_count ? hand + 1 : first_private;
+        unlink(result);
+        linked--;
+    }
+    assign(result, name, hash);
+    if (recycled) {
+        slot_at(result).pins.fetch_sub(recycling_pin, std::memory_order_release);
     }
-    name_table[name] = index;
-    index_table[index] = name;
-    result = index;
-    index = (index + 1) % addr_count;
+    count.store(current_count, std::memory_order_release);
     mutex.unlock();
     return result;
 }
 
+size_t resolve_table::shared_index(const std::string &name, uint32_t hash, bool publish) {
+    if (shared == NULL || name.length() == 0 || name.length() >= sizeof(shared_table::slot::name)) {
+        return addr_count;
+    }
+    uint32_t index = shared->find(name.data(), name.length(), hash);
+    if (index == shared_table::slot_count && publish) {
+        // the table is read only here, skiad publishes the name without
+        // anyone waiting for it
+        daemon_messages::instance().send(shared_table::publish_message, name.data(), name.length());
+    }
+    return index != shared_table::slot_count ? first_shared + index : addr_count;
+}
+
 size_t resolve_table::name_to_index(const std::string &name) {
-    size_t index = 0;
-    mutex.lock_shared();
-    auto entry = name_table.find(name);
-    if (entry != name_table.end()) {
-        index = entry->second;
+    uint32_t value = hash(name.data(), name.length());
+    size_t index = shared_index(name, value, false);
+    if (index == addr_count) {
+        mutex.lock_shared();
+        index = find_index(name, value);
         mutex.unlock_shared();
-    } else {
-        mutex.unlock_shared();
-        index = make_index(name);
+    }
+    if (index == addr_count) {
+        index = shared_index(name, value, true);
+    }
+    if (index == addr_count) {
+        index = make_index(name, value);
     }
     return index;
 }
 
-std::string resolve_table::index_to_name(const size_t &index) {
-    std::string name;
-    mutex.lock_shared();
-    auto entry = index_table.find(index);
-    if (entry != index_table.end()) {
-        name = entry->second;
+resolve_table::name_ref resolve_table::index_to_name(const size_t &index) {
+    if (index < first_private) {
+        // another generation of the shared table when out of range
+        uint32_t length;
+        const char *name = index >= first_shared ? shared->name_at(static_cast<uint32_t>(index - first_shared), length) : NULL;
+        return name != NULL ? name_ref(name, length, shared->slots[index - first_shared].hash, NULL) : name_ref();
     }
-    mutex.unlock_shared();
-    return name;
+    if (index >= count.load(std::memory_order_acquire)) {
+        return name_ref();
+    }
+    slot &s = slot_at(index);
+    s.referenced.store(true, std::memory_order_relaxed);
+    s.readers.fetch_add(1);
+    name_entry *entry = s.name.load();
+    entry->refs.fetch_add(1, std::memory_order_relaxed);
+    s.readers.fetch_sub(1, std::memory_order_release);
+    return name_ref(entry->name, entry->length, entry->hash, entry);
 }
 
 in_addr_t resolve_table::index_to_addr(const size_t &index) {
@@ -224,10 +917,45 @@ in_addr_t resolve_table::name_to_addr(const std::string &name) {
     return index_to_addr(name_to_index(name));
 }
 
-std::string resolve_table::addr_to_name(const in_addr_t &addr) {
+resolve_table::name_ref resolve_table::addr_to_name(const in_addr_t &addr) {
     return index_to_name(addr_to_index(addr));
 }
 
 bool resolve_table::is_resolved_addr(const in_addr_t &addr) {
     return reinterpret_cast<const uint8_t *>(&addr)[0] == addr_prefix;
 }
+
+void resolve_table::name_to_addr(const std::string &name, struct in6_addr &addr) {
+    in_addr_t addr_v4 = name_to_addr(name);
+    memcpy(&addr, addr6_prefix, sizeof(addr6_prefix));
+    memcpy(reinterpret_cast<uint8_t *>(&addr) + sizeof(addr6_prefix), &addr_v4, sizeof(addr_v4));
+}
+
+resolve_table::name_ref resolve_table::addr_to_name(const struct in6_addr &addr, bool ipv6) {
+    return addr_to_name(addr.__u6_addr.__u6_addr32[ipv6 ? 3 : 0]);
+}
+
+bool resolve_table::is_resolved_addr(const struct in6_addr &addr, bool ipv6) {
+    if (ipv6 && memcmp(&addr, addr6_prefix, sizeof(addr6_prefix)) != 0) {
+        return false;
+    }
+    return is_resolved_addr(addr.__u6_addr.__u6_addr32[ipv6 ? 3 : 0]);
+}
+
+bool resolve_table::pin(const in_addr_t &addr, const name_ref &name) {
+    size_t index = addr_to_index(addr);
+    if (!is_resolved_addr(addr) || index < first_private || index >= count.load(std::memory_order_acquire) || name.owner == NULL) {
+        return false; // shared slots are never recycled
+    }
+    slot &s = slot_at(index);
+    if ((s.pins.fetch_add(1, std::memory_order_acquire) & recycling_pin) != 0 || s.name.load(std::memory_order_acquire) != name.owner) {
+        // taken by the hand meanwhile
+        s.pins.fetch_sub(1, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+void resolve_table::unpin(const in_addr_t &addr) {
+    slot_at(addr_to_index(addr)).pins.fetch_sub(1, std::memory_order_release);
+}
@@ -1,14 +1,21 @@
 #include <string>
 #include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
 #include <unordered_map>
+#include <unordered_set>
+#include <deque>
+#include <condition_variable>
 #include <shared_mutex>
+#include <pthread.h>
 #include <arpa/inet.h>
-#include <sys/syslog.h>
 #include "config.hpp"
-
-#define log_(level, format, args...) syslog(LOG_##level, "Skia: " format, ##args)
-#define log(format, args...) log_(NOTICE, format, ##args)
-#define err(format, args...) log_(ERR, format, ##args)
+#include "proxy.hpp"
+#include "logger.hpp"
+#include "shared_table.hpp"
+#include "stats_table.hpp"
 
 #define DEBUG 0
 
@@ -18,65 +25,306 @@
 #define debug(code)
 #endif
 
-struct socket_address {
-    in_addr_t addr = 0;
-    in_port_t port = 0;
-    socket_address() {}
-    socket_address(in_addr_t addr, in_port_t port): addr(htonl(addr)), port(htons(port)) {}
+// Proxies that failed recently. Lists handed out meanwhile skip them, unless
+// nothing else is left to try. Recent latencies of each phase are kept as well
+// to derive adaptive timeouts.
+class proxy_health {
+private:
+    struct latency {
+        static const size_t sample_count = 32;
+        uint32_t samples[phase_count][sample_count]; // microseconds
+        size_t count[phase_count] = {0, 0, 0};
+        uint8_t backoff[phase_count] = {0, 0, 0}; // doublings of the timeout since the phase last completed
+        std::chrono::steady_clock::time_point updated;
+    };
+    // latencies are recorded on every phase, so they are sharded by proxy
+    // instead of sharing the lock of the failures
+    struct latency_shard {
+        std::mutex mutex;
+        std::unordered_map<uint64_t, latency> latencies;
+    };
+    static const size_t shard_count = 16;
+    static const size_t shard_capacity = 256 / shard_count;
+    std::unordered_map<uint64_t, std::chrono::steady_clock::time_point> failures;
+    latency_shard shards[shard_count];
+    std::atomic<size_t> failure_count;
+    std::mutex mutex;
+    static uint64_t key(const socket_address &proxy) { return static_cast<uint64_t>(proxy.addr) << 16 | proxy.port; }
+    latency_shard &shard(uint64_t proxy_key) { return shards[(proxy_key ^ proxy_key >> 16 ^ proxy_key >> 32) % shard_count]; }
+public:
+    static const int penalty_sec = 30;
+    static const uint32_t adaptive_min_msec = 200; // floor of adaptive timeouts
+    static const size_t adaptive_min_samples = 8; // samples needed before adapting
+    static const uint8_t adaptive_max_backoff = 6; // enough to take the floor past the default limit
+    proxy_health(): failure_count(0) {}
+    void failed(const socket_address &proxy);
+    void succeeded(const socket_address &proxy);
+    proxy_list filter(const proxy_list &proxies);
+    void observed(const socket_address &proxy, proxy_phase phase, uint32_t usec);
+    void expired(const socket_address &proxy, proxy_phase phase);
+    uint32_t adaptive_timeout(const socket_address &proxy, proxy_phase phase, uint32_t limit_msec);
 };
 
-struct socket_network {
-    in_addr_t addr = 0, mask = 0;
-    in_port_t port = 0;
-    socket_network() {}
-    socket_network(in_addr_t addr, in_addr_t mask, in_port_t port): addr(htonl(addr)), mask(htonl(mask)), port(htons(port)) {}
+// Rules declared by the config script in its global rules array, compiled into
+// native matchers and evaluated in order before queryProxy is called.
+class proxy_rules {
+private:
+    struct rule {
+        domain_set domains;
+        network_set networks;
+        std::unordered_set<uint16_t> ports;
+        bool has_domains = false, has_networks = false;
+        bool script = false;
+        proxy_list proxies;
+        bool no_cache = false;
+        uint32_t ttl = 0;
+    };
+    std::vector<rule> rules;
+public:
+    void compile(JSContextRef context, const std::string &application);
+    bool evaluate(const std::string &target_name, uint16_t target_port, proxy_list &proxies, bool &no_cache, uint32_t &ttl) const;
 };
 
-class skia {
+// Messages to skiad on SharedTablePort, sent one way from a thread of their
+// own so that no caller waits for the daemon. Messages are dropped while more
+// than max_queued are waiting, when skiad is gone or falls behind.
+class daemon_messages {
 private:
-    std::unordered_map<std::string, socket_address> proxy_cache;
-    std::shared_timed_mutex mutex;
-    config proxy_config;
-    const std::vector<socket_network> bypass_networks = {
-        socket_network(0x7f000000, 0xff000000, 0), // loopback 127.0.0.0/255.0.0.0
-        socket_network(0x0a000000, 0xff000000, 0), // private network 10.0.0.0/255.0.0.0
-        socket_network(0xac100000, 0xfff00000, 0), // private network 172.16.0.0/255.240.0.0
-        socket_network(0xc0a80000, 0xffff0000, 0), // private network 192.168.0.0/255.255.0.0
+    static const size_t max_queued = 256;
+    static constexpr double send_timeout = 1; // seconds
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<std::pair<int32_t, std::string>> queue;
+    bool started = false;
+    void run();
+public:
+    static daemon_messages &instance();
+    void send(int32_t message, const void *data, size_t length);
+};
+
+// Connection metrics of this process. Each thread counts into its own block
+// without contention, and every few seconds the blocks are added up by
+// whichever thread records something then and sent to skiad as a report,
+// skiad being the only writer of the stats table. Proxy metrics come with far
+// fewer events and are added up under a lock.
+class metrics {
+private:
+    struct block {
+        metrics *owner;
+        std::atomic<uint32_t> counters[stats_table::counter_count];
+        std::atomic<uint32_t> histograms[stats_table::histogram_count][stats_table::bucket_count];
     };
-    skia() {}
-    ~skia() {}
-    std::string current_application();
-    socket_address query_proxy(const std::string &target_name, const uint16_t &target_port, bool &no_cache);
+    static const int flush_sec = 5;
+    pthread_key_t key;
+    std::vector<block *> blocks;
+    stats_table::report pending; // blocks added up so far, guarded by blocks_mutex
+    std::mutex blocks_mutex;
+    std::unordered_map<uint64_t, stats_table::proxy_report> proxies;
+    std::mutex proxies_mutex;
+    std::atomic<int64_t> next_flush;
+    block *thread_block();
+    static void release_block(void *data);
+    void collect(block *b);
+    void maybe_flush();
+    stats_table::proxy_report *proxy_report(const socket_address &proxy);
 public:
-    static skia &instance();
-    bool should_bypass(const int &sock);
-    bool should_bypass(const struct sockaddr *addr);
-    bool should_bypass(const struct in6_addr &target_addr, const in_port_t &target_port, bool ipv6);
-    bool should_bypass(const std::string &target_name, const std::string &target_serv);
-    void extract_target(const struct sockaddr *addr, struct in6_addr &target_addr, in_port_t &target_port, bool &ipv6);
-    socket_address query_proxy(const std::string &target_name, const uint16_t &target_port);
-    socket_address query_proxy(const struct in6_addr &target_addr, const in_port_t &target_port, bool ipv6);
+    metrics(const std::string &application);
+    void count(stats_table::counter counter);
+    void sample(stats_table::histogram histogram, uint32_t usec);
+    void proxy_count(const socket_address &proxy, int counter);
+    void proxy_sample(const socket_address &proxy, stats_table::proxy_histogram histogram, uint32_t usec);
 };
 
+// Maps host names to fake addresses in 240.0.0.0/8. Slots form a ring indexed
+// by address, allocated lazily in chunks, with a chained hash from names to
+// slots. Once every address is taken, a clock hand recycles the first slot
+// that has not been looked up since the hand last passed it and that no
+// connect in progress is pinned to.
+// Names are reference counted, so a name handed out stays valid after its
+// slot is recycled and is freed once the last holder lets go of it. Reverse
+// lookups take no lock: a slot counts the lookups between loading its name
+// and counting a reference to it, and a writer replacing the name waits for
+// those few instructions before letting go of the old one. The mutex guards
+// the hash chains, for writers and for lookups by name.
+// When skiad provides the shared table, the leading addresses come from it so
+// every process agrees on them, and their names are read from the mapped
+// table. Names it does not hold yet are sent to skiad to publish in the
+// background and go to the private ring meanwhile, to be found in the shared
+// table by later lookups. The private ring takes the addresses after those of
+// every shared table generation.
+// Every fake address also has an IPv6 form in fd73:6b69:6100::/96, a unique
+// local prefix whose last 32 bits are the IPv4 form.
 class resolve_table {
 private:
-    std::unordered_map<std::string, size_t> name_table;
-    std::unordered_map<size_t, std::string> index_table;
-    std::shared_timed_mutex mutex;
-    size_t index = 0;
+    struct name_entry {
+        std::atomic<uint32_t> refs; // one for the slot holding it, one per name_ref
+        uint32_t length;
+        uint32_t hash;
+        char name[1]; // NUL terminated, allocated to fit
+    };
+public:
+    // A name behind a fake address. Private names are counted and freed by
+    // their last holder, shared ones stay mapped while the process runs and
+    // are handed out uncounted.
+    class name_ref {
+    private:
+        friend class resolve_table;
+        const char *data;
+        uint32_t len;
+        uint32_t value;
+        name_entry *owner;
+        name_ref(const char *data, uint32_t len, uint32_t value, name_entry *owner): data(data), len(len), value(value), owner(owner) {}
+        void retain() const {
+            if (owner != NULL) {
+                owner->refs.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    public:
+        name_ref(): data(""), len(0), value(0), owner(NULL) {}
+        name_ref(const name_ref &other): data(other.data), len(other.len), value(other.value), owner(other.owner) { retain(); }
+        name_ref &operator=(const name_ref &other) {
+            other.retain();
+            release(owner);
+            data = other.data;
+            len = other.len;
+            value = other.value;
+            owner = other.owner;
+            return *this;
+        }
+        ~name_ref() { release(owner); }
+        const char *c_str() const { return data; }
+        size_t length() const { return len; }
+        bool empty() const { return len == 0; }
+        uint32_t hash() const { return value; } // resolve_table::hash of the name
+        std::string str() const { return std::string(data, len); }
+    };
+private:
+    struct slot {
+        std::atomic<name_entry *> name{NULL}; // replaced by writers only
+        std::atomic<uint32_t> readers{0}; // lookups between loading the name and counting it
+        uint32_t next = 0; // next slot + 1 in the same bucket
+        std::atomic<bool> referenced{false};
+        std::atomic<uint32_t> pins{0}; // connects in progress, or recycling_pin while the hand takes the slot
+    };
+    static const uint32_t recycling_pin = 1u << 31;
+    static const size_t chunk_bits = 12;
+    static const size_t chunk_size = 1 << chunk_bits;
+    static const size_t chunk_count = (1 << 24) >> chunk_bits;
+    std::atomic<slot *> chunks[chunk_count];
+    std::atomic<size_t> count;
+    std::vector<uint32_t> buckets; // slot + 1, 0 for none
+    std::shared_timed_mutex mutex; // guards the buckets and the chains
+    size_t linked = 0;
+    size_t hand = 0;
+    const shared_table *shared;
+    size_t first_shared;
+    size_t first_private;
     const uint8_t addr_prefix = 240;
     const uint8_t bits_count = (sizeof(in_addr_t) - sizeof(addr_prefix)) * 8;
     const size_t addr_count = (1 << bits_count) - 1;
-    resolve_table() {}
-    ~resolve_table() {}
-    size_t make_index(const std::string &name);
+    static const uint8_t addr6_prefix[12];
+    resolve_table(): chunks(), count(0), buckets(chunk_size), shared(shared_table::map(false)) {
+        first_shared = shared != NULL ? shared->first_index() : 0;
+        first_private = shared != NULL ? shared_table::generation_count * shared_table::slot_count : 0;
+        count = hand = first_private;
+    }
+    ~resolve_table() {
+        for (std::atomic<slot *> &chunk : chunks) {
+            slot *c = chunk.load();
+            for (size_t i = 0; c != NULL && i < chunk_size; i++) {
+                release(c[i].name.load());
+            }
+            delete[] c;
+        }
+    }
+    static name_entry *make_entry(const std::string &name, uint32_t hash);
+    static void release(name_entry *entry);
+    slot &slot_at(size_t index) { return chunks[index >> chunk_bits].load(std::memory_order_acquire)[index & (chunk_size - 1)]; }
+    size_t find_index(const std::string &name, uint32_t hash);
+    void unlink(size_t index);
+    void link(size_t index);
+    void assign(size_t index, const std::string &name, uint32_t hash);
+    size_t make_index(const std::string &name, uint32_t hash);
+    size_t shared_index(const std::string &name, uint32_t hash, bool publish);
     size_t name_to_index(const std::string &name);
-    std::string index_to_name(const size_t &index);
+    name_ref index_to_name(const size_t &index);
     in_addr_t index_to_addr(const size_t &index);
     size_t addr_to_index(const in_addr_t &addr);
 public:
     static resolve_table &instance();
+    // The same FNV-1a as the shared table, so private and shared names agree.
+    static uint32_t hash(const char *name, size_t length) { return shared_table::hash(name, length); }
     in_addr_t name_to_addr(const std::string &name);
-    std::string addr_to_name(const in_addr_t &addr);
+    void name_to_addr(const std::string &name, struct in6_addr &addr);
+    name_ref addr_to_name(const in_addr_t &addr);
+    name_ref addr_to_name(const struct in6_addr &addr, bool ipv6);
     bool is_resolved_addr(const in_addr_t &addr);
+    bool is_resolved_addr(const struct in6_addr &addr, bool ipv6);
+    // Keeps the slot of a fake address from being recycled while a connect
+    // to it is in progress, provided it still holds the name. Each successful
+    // pin is undone by an unpin.
+    bool pin(const in_addr_t &addr, const name_ref &name);
+    void unpin(const in_addr_t &addr);
+};
+
+// Destination of a connection. The name behind a fake address is looked up
+// once, along with the address, and goes with the target from then on.
+struct connect_target {
+    struct in6_addr addr;
+    in_port_t port; // network byte order
+    bool ipv6;
+    bool resolved = false; // a fake address, standing for name
+    resolve_table::name_ref name;
+    // Valid for as long as the target.
+    log_host host() const {
+        log_host result;
+        result.name = resolved ? name.c_str() : NULL;
+        result.addr = addr;
+        result.ipv6 = ipv6;
+        return result;
+    }
+};
+
+class skia {
+private:
+    // What queryProxy is called with, looked up and protected once per context.
+    // A context only runs under its own lock, so the first caller holding it
+    // fills its slot and later ones read it without locking.
+    struct script_values {
+        std::atomic<JSGlobalContextRef> context{NULL};
+        JSObjectRef query_function = NULL;
+        JSValueRef application = NULL;
+    };
+    static const size_t script_context_count = 4;
+    const std::string application;
+    JSStringRef application_string;
+    script_values context_values[script_context_count];
+    proxy_cache decision_cache;
+    config proxy_config;
+    proxy_rules native_rules;
+    proxy_health health;
+    proxy_timeouts default_timeouts;
+    network_set bypass_networks;
+    metrics stats;
+    skia();
+    ~skia() { JSStringRelease(application_string); }
+    static std::string current_application();
+    const script_values *prepare_context(JSGlobalContextRef context);
+    proxy_list query_proxy(const std::string &target_name, const uint16_t &target_port, bool &no_cache, uint32_t &ttl);
+    template <typename Name> proxy_list query_proxy(const char *key, size_t key_len, uint32_t key_hash, uint16_t target_port, Name target_name);
+public:
+    static skia &instance();
+    bool should_bypass(const int &sock);
+    bool should_bypass(const struct sockaddr *addr);
+    bool should_bypass(const struct in6_addr &target_addr, const in_port_t &target_port, bool ipv6);
+    bool should_bypass(const std::string &target_name, const std::string &target_serv);
+    void extract_target(const struct sockaddr *addr, connect_target &target);
+    proxy_list query_proxy(const std::string &target_name, const uint16_t &target_port);
+    proxy_list query_proxy(const connect_target &target);
+    void proxy_failed(const socket_address &proxy) { health.failed(proxy); }
+    void proxy_succeeded(const socket_address &proxy) { health.succeeded(proxy); }
+    void proxy_observed(const socket_address &proxy, proxy_phase phase, uint32_t usec) { health.observed(proxy, phase, usec); }
+    void proxy_expired(const socket_address &proxy, proxy_phase phase) { health.expired(proxy, phase); }
+    uint32_t proxy_timeout(const proxy_address &proxy, proxy_phase phase);
+    metrics &connection_stats() { return stats; }
 };
@@ -1,6 +1,9 @@
 #import <Foundation/Foundation.h>
 #import <UIKit/UIKit.h>
 #import "config.hpp"
+#import "shared_table.hpp"
+#import "health_table.hpp"
+#import "stats_table.hpp"
 
 #define SkiaIdentifier @"me.qusic.skia"
 #define ShadowSocksIdentifier @"me.qusic.shadowsocks"
@@ -9,11 +12,19 @@
 #define BundlePath @"/Library/PreferenceBundles/skiapref.bundle"
 #define ProxyFile BundlePath"/proxy.js"
 #define ConfigFile @"/User/Library/Preferences/me.qusic.skia.js"
+#define PreferencesFile @"/User/Library/Preferences/me.qusic.skia.plist"
 #define ConfigSampleFile BundlePath"/config.js"
 #define ConfigViewBaseURL BundlePath"/view"
 
 #define DaemonsMessage @"Daemons"
 #define OperationMessage @"Operation"
+#define HealthMessage @"Health"
+#define StatsMessage @"Stats"
+
+#define HealthCheckTargetKey @"HealthCheckTarget"
+#define HealthCheckDefaultTarget @"www.google.com:80"
+#define HealthCheckInterval 60
+#define HealthCheckTimeout 10 // seconds a single probe may take, well within the interval
 
 @interface CPDistributedMessagingCenter : NSObject
 + (instancetype)centerNamed:(NSString *)name;
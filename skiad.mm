@@ -1,10 +1,24 @@
 #import "skiad.h"
+#import <chrono>
+#import <poll.h>
+#import <fcntl.h>
+#import <sys/socket.h>
 
 @interface SkiaService : NSObject
+- (CFDataRef)processPortMessage:(SInt32)messageID data:(CFDataRef)data;
 @end
 
+static CFDataRef receivePortMessage(CFMessagePortRef port, SInt32 messageID, CFDataRef data, void *info) {
+    return [(__bridge SkiaService *)info processPortMessage:messageID data:data];
+}
+
 @implementation SkiaService {
     CPDistributedMessagingCenter *messagingCenter;
+    shared_table *sharedTable;
+    health_table *healthTable;
+    stats_table *statsTable;
+    dispatch_queue_t healthQueue;
+    dispatch_source_t healthTimer;
 }
 
 + (instancetype)sharedInstance {
@@ -20,6 +34,10 @@
     self = [super init];
     if (self) {
         messagingCenter = [CPDistributedMessagingCenter centerNamed:SkiaIdentifier];
+        sharedTable = shared_table::map(true);
+        healthTable = health_table::map(true);
+        statsTable = stats_table::map();
+        healthQueue = dispatch_queue_create("me.qusic.skia.health", DISPATCH_QUEUE_SERIAL);
     }
     return self;
 }
@@ -28,6 +46,46 @@
     [messagingCenter runServerOnCurrentThread];
     [messagingCenter registerForMessageName:DaemonsMessage target:self selector:@selector(processDaemonsRequest:data:)];
     [messagingCenter registerForMessageName:OperationMessage target:self selector:@selector(processOperationRequest:data:)];
+    [messagingCenter registerForMessageName:HealthMessage target:self selector:@selector(processHealthRequest:data:)];
+    [messagingCenter registerForMessageName:StatsMessage target:self selector:@selector(processStatsRequest:data:)];
+    CFMessagePortContext context = {0, (__bridge void *)self, NULL, NULL, NULL};
+    CFMessagePortRef port = CFMessagePortCreateLocal(kCFAllocatorDefault, CFSTR(SharedTablePort), receivePortMessage, &context, NULL);
+    if (port != NULL) {
+        CFRunLoopSourceRef source = CFMessagePortCreateRunLoopSource(kCFAllocatorDefault, port, 0);
+        CFRunLoopAddSource(CFRunLoopGetCurrent(), source, kCFRunLoopCommonModes);
+        CFRelease(source);
+    }
+    if (healthTable != NULL) {
+        healthTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, healthQueue);
+        dispatch_source_set_timer(healthTimer, dispatch_time(DISPATCH_TIME_NOW, 5 * NSEC_PER_SEC), HealthCheckInterval * NSEC_PER_SEC, 5 * NSEC_PER_SEC);
+        dispatch_source_set_event_handler(healthTimer, ^{
+            [self checkHealth];
+        });
+        dispatch_resume(healthTimer);
+    }
+}
+
+// Injected processes map the shared table read only and send the names it
+// lacks here without waiting for a reply. A full table is followed by the next
+// generation. They send their stats reports here as well, since skiad alone
+// writes the stats table.
+- (CFDataRef)processPortMessage:(SInt32)messageID data:(CFDataRef)data {
+    if (messageID == shared_table::publish_message && data != NULL && sharedTable != NULL) {
+        const char *name = reinterpret_cast<const char *>(CFDataGetBytePtr(data));
+        size_t length = CFDataGetLength(data);
+        if (sharedTable->publish(name, length) == shared_table::slot_count && sharedTable->full()) {
+            shared_table *next = shared_table::create(sharedTable->generation + 1);
+            if (next != NULL) {
+                munmap(sharedTable, sizeof(shared_table));
+                sharedTable = next;
+                sharedTable->publish(name, length);
+            }
+        }
+    }
+    if (messageID == stats_table::report_message && data != NULL && statsTable != NULL) {
+        statsTable->add(CFDataGetBytePtr(data), CFDataGetLength(data));
+    }
+    return NULL;
 }
 
 - (BOOL)validateDaemonName:(NSString *)name {
@@ -95,6 +153,193 @@
     [[NSTask launchedTaskWithLaunchPath:LaunchCtl arguments:@[command, target]]waitUntilExit];
 }
 
+- (NSString *)healthCheckTarget {
+    NSString *target = [NSDictionary dictionaryWithContentsOfFile:PreferencesFile][HealthCheckTargetKey];
+    return [target isKindOfClass:NSString.class] && [target rangeOfString:@":"].location != NSNotFound ? target : HealthCheckDefaultTarget;
+}
+
+// Time to the first byte of a HEAD request through the proxy, in microseconds,
+// or -1 on failure. ss-local answers the SOCKS5 request before reaching the
+// server, so only a reply from the target tells the whole path is working.
+// The socket is non-blocking and the whole probe gives up after the health
+// check timeout, so a stalled proxy holds up neither its check nor the next.
+- (int64_t)probeProxyAddress:(in_addr_t)address port:(in_port_t)port target:(NSString *)target {
+    NSUInteger separator = [target rangeOfString:@":" options:NSBackwardsSearch].location;
+    NSString *targetHost = [target substringToIndex:separator];
+    uint16_t targetPort = static_cast<uint16_t>([target substringFromIndex:separator + 1].integerValue);
+    const char *targetName = targetHost.UTF8String;
+    size_t targetNameLength = strlen(targetName);
+    if (targetNameLength == 0 || targetNameLength > UINT8_MAX || targetPort == 0) {
+        return -1;
+    }
+    int sock = socket(PF_INET, SOCK_STREAM, 0);
+    if (sock == -1) {
+        return -1;
+    }
+    int noSigPipe = 1;
+    setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, &noSigPipe, sizeof(noSigPipe));
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, NULL) | O_NONBLOCK);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point deadline = start + std::chrono::seconds(HealthCheckTimeout);
+    BOOL (^waitFor)(short) = ^(short events) {
+        while (true) {
+            int64_t remaining = std::chrono::duration_cast<std::chrono::microseconds>(deadline - std::chrono::steady_clock::now()).count();
+            if (remaining <= 0) {
+                return NO;
+            }
+            struct pollfd sockPoll = {sock, events, 0};
+            int result = poll(&sockPoll, 1, static_cast<int>((remaining + 999) / 1000));
+            if (result > 0) {
+                return YES;
+            } else if (result == 0 || errno != EINTR) {
+                return NO;
+            }
+        }
+    };
+    BOOL (^sendAll)(const void *, size_t) = ^(const void *bytes, size_t length) {
+        size_t total = 0;
+        while (total < length) {
+            ssize_t current = send(sock, static_cast<const uint8_t *>(bytes) + total, length - total, 0);
+            if (current > 0) {
+                total += current;
+            } else if (current == 0 || (errno != EAGAIN && errno != EINTR) || !waitFor(POLLOUT)) {
+                return NO;
+            }
+        }
+        return YES;
+    };
+    BOOL (^recvAll)(uint8_t *, size_t) = ^(uint8_t *bytes, size_t length) {
+        size_t total = 0;
+        while (total < length) {
+            ssize_t current = recv(sock, bytes + total, length - total, 0);
+            if (current > 0) {
+                total += current;
+            } else if (current == 0 || (errno != EAGAIN && errno != EINTR) || !waitFor(POLLIN)) {
+                return NO;
+            }
+        }
+        return YES;
+    };
+    struct sockaddr_in proxyAddr;
+    memset(&proxyAddr, 0, sizeof(proxyAddr));
+    proxyAddr.sin_len = sizeof(proxyAddr);
+    proxyAddr.sin_family = AF_INET;
+    proxyAddr.sin_addr.s_addr = address;
+    proxyAddr.sin_port = port;
+    int64_t result = -1;
+    uint8_t buffer[512];
+    do {
+        if (connect(sock, reinterpret_cast<struct sockaddr *>(&proxyAddr), sizeof(proxyAddr)) != 0) {
+            int error = 0;
+            socklen_t errorLength = sizeof(error);
+            if (errno != EINPROGRESS || !waitFor(POLLOUT) || getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &errorLength) != 0 || error != 0) {
+                break;
+            }
+        }
+        const uint8_t greeting[] = {5, 1, 0};
+        if (!sendAll(greeting, sizeof(greeting)) || !recvAll(buffer, 2) || buffer[0] != 5 || buffer[1] != 0) {
+            break;
+        }
+        size_t length = 0;
+        buffer[length++] = 5;
+        buffer[length++] = 1;
+        buffer[length++] = 0;
+        buffer[length++] = 3;
+        buffer[length++] = static_cast<uint8_t>(targetNameLength);
+        memcpy(buffer + length, targetName, targetNameLength);
+        length += targetNameLength;
+        buffer[length++] = targetPort >> 8;
+        buffer[length++] = targetPort & 0xff;
+        if (!sendAll(buffer, length) || !recvAll(buffer, 4) || buffer[1] != 0) {
+            break;
+        }
+        size_t remaining = buffer[3] == 1 ? 6 : buffer[3] == 4 ? 18 : 0;
+        if (buffer[3] == 3) {
+            if (!recvAll(buffer, 1)) {
+                break;
+            }
+            remaining = buffer[0] + 2;
+        }
+        if (remaining == 0 || !recvAll(buffer, remaining)) {
+            break;
+        }
+        NSData *request = [[NSString stringWithFormat:@"HEAD / HTTP/1.1\r\nHost: %@\r\nConnection: close\r\n\r\n", targetHost]dataUsingEncoding:NSUTF8StringEncoding];
+        if (!sendAll(request.bytes, request.length) || !recvAll(buffer, 1)) {
+            break;
+        }
+        result = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    } while (false);
+    close(sock);
+    return result;
+}
+
+// Runs on the health queue, the only writer of the health table. Proxies are
+// probed concurrently and their results applied once every probe is done.
+- (void)checkHealth {
+    NSString *target = self.healthCheckTarget;
+    __block uint64_t seen = 0; // one bit per entry
+    static_assert(health_table::entry_count <= 64, "entry bits must fit in seen");
+    health_table::entry *entryBuffer[health_table::entry_count];
+    health_table::entry **entries = entryBuffer;
+    __block size_t count = 0;
+    [self.daemonsStatusDictionary enumerateKeysAndObjectsUsingBlock:^(NSString *name, NSDictionary<NSString *, NSString *> *status, BOOL *stop) {
+        struct in_addr address;
+        in_port_t port = htons(static_cast<uint16_t>(status[@"LocalPort"].integerValue));
+        if (inet_aton(status[@"LocalAddress"].UTF8String, &address) != 1 || port == 0) {
+            return;
+        }
+        health_table::entry *e = healthTable->find(address.s_addr, port);
+        if (e == NULL) {
+            e = healthTable->find(0, 0);
+            if (e == NULL) {
+                return;
+            }
+            e->rtt_usec.store(0, std::memory_order_relaxed);
+            e->failures.store(0, std::memory_order_relaxed);
+            e->checked.store(0, std::memory_order_relaxed);
+            e->port.store(port, std::memory_order_relaxed);
+            e->addr.store(address.s_addr, std::memory_order_relaxed);
+        }
+        uint64_t bit = 1ULL << (e - healthTable->entries);
+        if (!(seen & bit)) {
+            seen |= bit;
+            entries[count++] = e;
+        }
+    }];
+    int64_t rttBuffer[health_table::entry_count];
+    int64_t *rtts = rttBuffer;
+    dispatch_group_t group = dispatch_group_create();
+    for (size_t i = 0; i < count; i++) {
+        in_addr_t address = entries[i]->addr.load(std::memory_order_relaxed);
+        in_port_t port = static_cast<in_port_t>(entries[i]->port.load(std::memory_order_relaxed));
+        dispatch_group_async(group, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+            rtts[i] = [self probeProxyAddress:address port:port target:target];
+        });
+    }
+    // every probe gives up after the timeout, so this wait is bounded too
+    dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+    for (size_t i = 0; i < count; i++) {
+        health_table::entry *e = entries[i];
+        int64_t rtt = rtts[i];
+        if (rtt >= 0) {
+            // moving average with a weight of 1/4 for the new sample
+            int64_t average = e->rtt_usec.load(std::memory_order_relaxed);
+            average = average == 0 ? rtt : average + (rtt - average) / 4;
+            e->rtt_usec.store(static_cast<uint32_t>(std::min<int64_t>(std::max<int64_t>(average, 1), UINT32_MAX)), std::memory_order_relaxed);
+            e->failures.store(0, std::memory_order_relaxed);
+        } else {
+            e->failures.fetch_add(1, std::memory_order_relaxed);
+        }
+        e->checked.store(static_cast<uint32_t>(time(NULL)), std::memory_order_relaxed);
+    }
+    for (uint32_t i = 0; i < health_table::entry_count; i++) {
+        if (!(seen & (1ULL << i))) {
+            healthTable->entries[i].addr.store(0, std::memory_order_relaxed);
+            healthTable->entries[i].port.store(0, std::memory_order_relaxed);
+        }
+    }
+}
+
 - (NSDictionary *)processDaemonsRequest:(NSString *)request data:(NSDictionary<NSString *, NSDictionary<NSString *, NSString *> *> *)data {
     if (data.count > 0) {
         [data enumerateKeysAndObjectsUsingBlock:^(NSString *name, NSDictionary<NSString *, NSString *> *config, BOOL *stop) {
@@ -118,6 +363,101 @@
     }
 }
 
+- (NSDictionary *)processHealthRequest:(NSString *)request data:(NSDictionary *)data {
+    NSMutableDictionary *health = [NSMutableDictionary dictionary];
+    if (healthTable == NULL) {
+        return health;
+    }
+    [self.daemonsStatusDictionary enumerateKeysAndObjectsUsingBlock:^(NSString *name, NSDictionary<NSString *, NSString *> *status, BOOL *stop) {
+        struct in_addr address;
+        in_port_t port = htons(static_cast<uint16_t>(status[@"LocalPort"].integerValue));
+        const health_table::entry *e = inet_aton(status[@"LocalAddress"].UTF8String, &address) == 1 ? healthTable->find(address.s_addr, port) : NULL;
+        if (e != NULL && e->checked.load(std::memory_order_relaxed) != 0) {
+            health[name] = @{
+                @"RTT": @(e->rtt_usec.load(std::memory_order_relaxed) / 1000.0),
+                @"Failures": @(e->failures.load(std::memory_order_relaxed)),
+                @"Checked": @(e->checked.load(std::memory_order_relaxed)),
+            };
+        }
+    }];
+    return health;
+}
+
+// Median, 90th and 99th percentiles in milliseconds, each the upper bound of
+// the bucket it falls in.
+- (NSDictionary<NSString *, NSNumber *> *)percentilesOfHistogram:(const std::atomic<uint32_t> *)histogram {
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < stats_table::bucket_count; i++) {
+        total += histogram[i].load(std::memory_order_relaxed);
+    }
+    if (total == 0) {
+        return nil;
+    }
+    NSMutableDictionary *percentiles = [NSMutableDictionary dictionary];
+    for (NSNumber *percent in @[@50, @90, @99]) {
+        uint64_t rank = (total * percent.unsignedIntegerValue + 99) / 100;
+        uint64_t seen = 0;
+        for (uint32_t i = 0; i < stats_table::bucket_count; i++) {
+            seen += histogram[i].load(std::memory_order_relaxed);
+            if (seen >= rank) {
+                percentiles[[NSString stringWithFormat:@"P%@", percent]] = @((1 << (i + 7)) / 1000.0);
+                break;
+            }
+        }
+    }
+    return percentiles;
+}
+
+- (NSDictionary *)processStatsRequest:(NSString *)request data:(NSDictionary *)data {
+    if (statsTable == NULL) {
+        return @{};
+    }
+    NSArray<NSString *> *counterNames = @[@"DecisionsCached", @"DecisionsRules", @"DecisionsScript", @"DecisionsEvicted", @"ConnectsDirect", @"ConnectsProxied", @"FailuresDirect", @"FailuresProxied"];
+    NSArray<NSString *> *histogramNames = @[@"DecisionCached", @"DecisionEvaluated", @"DirectConnect", @"ProxyConnect", @"ProxyHandshake"];
+    NSArray<NSString *> *proxyHistogramNames = @[@"Connect", @"Handshake"];
+    NSMutableDictionary *apps = [NSMutableDictionary dictionary];
+    for (const stats_table::app_entry &e : statsTable->apps) {
+        if (e.state.load(std::memory_order_acquire) != 1) {
+            continue;
+        }
+        NSMutableDictionary *app = [NSMutableDictionary dictionary];
+        for (uint32_t i = 0; i < stats_table::counter_count; i++) {
+            app[counterNames[i]] = @(e.counters[i].load(std::memory_order_relaxed));
+        }
+        for (uint32_t i = 0; i < stats_table::histogram_count; i++) {
+            app[histogramNames[i]] = [self percentilesOfHistogram:e.histograms[i]];
+        }
+        // written by skiad, but the file outlives it, so the name is bounded
+        // all the same
+        apps[[[NSString alloc]initWithBytes:e.name length:strnlen(e.name, sizeof(e.name)) encoding:NSUTF8StringEncoding] ?: @""] = app;
+    }
+    NSMutableDictionary *proxies = [NSMutableDictionary dictionary];
+    for (const stats_table::proxy_entry &e : statsTable->proxies) {
+        if (e.state.load(std::memory_order_acquire) != 1) {
+            continue;
+        }
+        NSMutableDictionary *proxy = [NSMutableDictionary dictionary];
+        proxy[@"Connects"] = @(e.counters[stats_table::proxy_connects].load(std::memory_order_relaxed));
+        proxy[@"FailuresConnect"] = @(e.counters[stats_table::proxy_failures_connect].load(std::memory_order_relaxed));
+        proxy[@"FailuresGreeting"] = @(e.counters[stats_table::proxy_failures_greeting].load(std::memory_order_relaxed));
+        proxy[@"FailuresReply"] = @(e.counters[stats_table::proxy_failures_reply].load(std::memory_order_relaxed));
+        NSMutableDictionary *codes = [NSMutableDictionary dictionary];
+        for (uint32_t code = 1; code <= 9; code++) {
+            uint32_t count = e.counters[stats_table::proxy_failures_code + code - 1].load(std::memory_order_relaxed);
+            if (count > 0) {
+                codes[code <= 8 ? [NSString stringWithFormat:@"%u", code] : @"Unknown"] = @(count);
+            }
+        }
+        proxy[@"FailuresCode"] = codes;
+        for (uint32_t i = 0; i < stats_table::proxy_histogram_count; i++) {
+            proxy[proxyHistogramNames[i]] = [self percentilesOfHistogram:e.histograms[i]];
+        }
+        struct in_addr address = {e.addr};
+        proxies[[NSString stringWithFormat:@"%s:%u", inet_ntoa(address), ntohs(static_cast<uint16_t>(e.port))]] = proxy;
+    }
+    return @{@"Apps": apps, @"Proxies": proxies};
+}
+
 - (NSDictionary *)processOperationRequest:(NSString *)request data:(NSDictionary<NSString *, NSString *> *)data {
     [data enumerateKeysAndObjectsUsingBlock:^(NSString *name, NSString *operation, BOOL *stop) {
         if ([self validateDaemonName:name]) {
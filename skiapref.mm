@@ -23,6 +23,9 @@ static UIImage *imageNamed(NSString *name) {
 @interface SkiaTestController : PSListController
 @end
 
+@interface SkiaStatsController : PSListController
+@end
+
 @interface SkiaPreferencesController ()
 @end
 
@@ -44,6 +47,7 @@ static UIImage *imageNamed(NSString *name) {
     if (_specifiers == nil) {
         NSMutableArray *specifiers = [NSMutableArray array];
         [specifiers addObjectsFromArray:self.daemonSpecifiers];
+        [specifiers addObjectsFromArray:self.healthSpecifiers];
         [specifiers addObjectsFromArray:self.configSpecifiers];
         [specifiers addObjectsFromArray:self.aboutSpecifiers];
         _specifiers = specifiers;
@@ -54,10 +58,18 @@ static UIImage *imageNamed(NSString *name) {
 - (NSArray *)daemonSpecifiers {
     NSMutableArray *specifiers = [NSMutableArray array];
     [specifiers addObject:[PSSpecifier groupSpecifierWithName:@"ShadowSocks Instances"]];
+    NSDictionary *health = [messagingCenter sendMessageAndReceiveReplyName:HealthMessage userInfo:@{} error:nil];
     [[messagingCenter sendMessageAndReceiveReplyName:DaemonsMessage userInfo:@{} error:nil]enumerateKeysAndObjectsUsingBlock:^(NSString *name, NSDictionary *properties, BOOL *stop) {
         PSSpecifier *specifier = [PSSpecifier preferenceSpecifierNamed:name target:self set:NULL get:NULL detail:SkiaDaemonController.class cell:PSLinkCell edit:Nil];
         [specifier setUserInfo:@[name, properties]];
-        [specifier setProperty:[NSString stringWithFormat:@"%@:%@", properties[@"LocalAddress"], properties[@"LocalPort"]] forKey:@"cellSubtitleText"];
+        NSString *subtitle = [NSString stringWithFormat:@"%@:%@", properties[@"LocalAddress"], properties[@"LocalPort"]];
+        NSDictionary *status = health[name];
+        if (status != nil) {
+            subtitle = [status[@"Failures"] integerValue] > 0
+                ? [subtitle stringByAppendingFormat:@", failed %@ checks", status[@"Failures"]]
+                : [subtitle stringByAppendingFormat:@", %.0f ms", [status[@"RTT"] doubleValue]];
+        }
+        [specifier setProperty:subtitle forKey:@"cellSubtitleText"];
         [specifier setProperty:imageNamed(@"instance") forKey:@"iconImage"];
         [specifiers addObject:specifier];
     }];
@@ -67,12 +79,24 @@ static UIImage *imageNamed(NSString *name) {
     return specifiers;
 }
 
+- (NSArray *)healthSpecifiers {
+    PSSpecifier *groupSpecifier = [PSSpecifier groupSpecifierWithName:@"Health Check"];
+    [groupSpecifier setProperty:@"Instances are checked every minute by requesting this host:port through them. Scripts read the results with proxyHealth and bestProxy." forKey:@"footerText"];
+    PSSpecifier *targetSpecifier = [PSSpecifier preferenceSpecifierNamed:@"Target" target:self set:@selector(setPreferenceValue:specifier:) get:@selector(readPreferenceValue:) detail:Nil cell:PSEditTextCell edit:Nil];
+    [targetSpecifier setProperty:SkiaIdentifier forKey:@"defaults"];
+    [targetSpecifier setProperty:HealthCheckTargetKey forKey:@"key"];
+    [targetSpecifier setProperty:HealthCheckDefaultTarget forKey:@"default"];
+    [targetSpecifier setKeyboardType:UIKeyboardTypeURL autoCaps:UITextAutocapitalizationTypeNone autoCorrection:UITextAutocorrectionTypeNo];
+    return @[groupSpecifier, targetSpecifier];
+}
+
 - (NSArray *)configSpecifiers {
     PSSpecifier *viewSpecifier = [PSSpecifier preferenceSpecifierNamed:@"View Script" target:self set:NULL get:NULL detail:SkiaConfigController.class cell:PSLinkCell edit:Nil];
     [viewSpecifier setProperty:imageNamed(@"view") forKey:@"iconImage"];
     PSSpecifier *testSpecifier = [PSSpecifier preferenceSpecifierNamed:@"Result Test" target:self set:NULL get:NULL detail:SkiaTestController.class cell:PSLinkCell edit:Nil];
     [testSpecifier setProperty:imageNamed(@"test") forKey:@"iconImage"];
-    return @[[PSSpecifier groupSpecifierWithName:@"Proxy Configuration"], viewSpecifier, testSpecifier];
+    PSSpecifier *statsSpecifier = [PSSpecifier preferenceSpecifierNamed:@"Statistics" target:self set:NULL get:NULL detail:SkiaStatsController.class cell:PSLinkCell edit:Nil];
+    return @[[PSSpecifier groupSpecifierWithName:@"Proxy Configuration"], viewSpecifier, testSpecifier, statsSpecifier];
 }
 
 - (NSArray *)aboutSpecifiers {
@@ -389,3 +413,73 @@ static UIImage *imageNamed(NSString *name) {
 }
 
 @end
+
+@interface SkiaStatsController ()
+@end
+
+@implementation SkiaStatsController
+
+- (NSArray *)specifiers {
+    if (_specifiers == nil) {
+        NSDictionary *stats = [messagingCenter sendMessageAndReceiveReplyName:StatsMessage userInfo:@{} error:nil];
+        NSMutableArray *specifiers = [NSMutableArray array];
+        PSSpecifier *refreshSpecifier = [PSSpecifier preferenceSpecifierNamed:@"Refresh" target:self set:NULL get:NULL detail:Nil cell:PSButtonCell edit:Nil];
+        refreshSpecifier.buttonAction = @selector(specifierAction:);
+        PSSpecifier *groupSpecifier = [PSSpecifier groupSpecifierWithName:nil];
+        [groupSpecifier setProperty:@"Latencies are the 50th, 90th and 99th percentiles." forKey:@"footerText"];
+        [specifiers addObjectsFromArray:@[groupSpecifier, refreshSpecifier]];
+        NSDictionary<NSString *, NSDictionary *> *proxies = stats[@"Proxies"];
+        for (NSString *name in [proxies.allKeys sortedArrayUsingSelector:@selector(compare:)]) {
+            NSDictionary *proxy = proxies[name];
+            [specifiers addObject:[PSSpecifier groupSpecifierWithName:[@"Proxy " stringByAppendingString:name]]];
+            [specifiers addObject:[self statSpecifierNamed:@"Connects" value:[proxy[@"Connects"] description]]];
+            [specifiers addObject:[self statSpecifierNamed:@"Failed Connect / Greeting / Reply" value:[NSString stringWithFormat:@"%@ / %@ / %@", proxy[@"FailuresConnect"], proxy[@"FailuresGreeting"], proxy[@"FailuresReply"]]]];
+            NSDictionary<NSString *, NSNumber *> *codes = proxy[@"FailuresCode"];
+            for (NSString *code in [codes.allKeys sortedArrayUsingSelector:@selector(compare:)]) {
+                [specifiers addObject:[self statSpecifierNamed:[@"Reply Code " stringByAppendingString:code] value:codes[code].description]];
+            }
+            [specifiers addObject:[self statSpecifierNamed:@"Connect" value:[self latencyText:proxy[@"Connect"]]]];
+            [specifiers addObject:[self statSpecifierNamed:@"Handshake" value:[self latencyText:proxy[@"Handshake"]]]];
+        }
+        NSDictionary<NSString *, NSDictionary *> *apps = stats[@"Apps"];
+        for (NSString *name in [apps.allKeys sortedArrayUsingSelector:@selector(compare:)]) {
+            NSDictionary *app = apps[name];
+            [specifiers addObject:[PSSpecifier groupSpecifierWithName:name]];
+            [specifiers addObject:[self statSpecifierNamed:@"Cached / Rules / Script" value:[NSString stringWithFormat:@"%@ / %@ / %@", app[@"DecisionsCached"], app[@"DecisionsRules"], app[@"DecisionsScript"]]]];
+            [specifiers addObject:[self statSpecifierNamed:@"Evicted from Cache" value:[NSString stringWithFormat:@"%@", app[@"DecisionsEvicted"]]]];
+            [specifiers addObject:[self statSpecifierNamed:@"Direct / Proxied" value:[NSString stringWithFormat:@"%@ / %@", app[@"ConnectsDirect"], app[@"ConnectsProxied"]]]];
+            [specifiers addObject:[self statSpecifierNamed:@"Failed Direct / Proxied" value:[NSString stringWithFormat:@"%@ / %@", app[@"FailuresDirect"], app[@"FailuresProxied"]]]];
+            [specifiers addObject:[self statSpecifierNamed:@"Cached Decision" value:[self latencyText:app[@"DecisionCached"]]]];
+            [specifiers addObject:[self statSpecifierNamed:@"Evaluated Decision" value:[self latencyText:app[@"DecisionEvaluated"]]]];
+            [specifiers addObject:[self statSpecifierNamed:@"Direct Connect" value:[self latencyText:app[@"DirectConnect"]]]];
+            [specifiers addObject:[self statSpecifierNamed:@"Proxy Connect" value:[self latencyText:app[@"ProxyConnect"]]]];
+            [specifiers addObject:[self statSpecifierNamed:@"Proxy Handshake" value:[self latencyText:app[@"ProxyHandshake"]]]];
+        }
+        _specifiers = specifiers;
+    }
+    return _specifiers;
+}
+
+- (PSSpecifier *)statSpecifierNamed:(NSString *)name value:(NSString *)value {
+    PSSpecifier *specifier = [PSSpecifier preferenceSpecifierNamed:name target:self set:NULL get:@selector(getValue:) detail:Nil cell:PSTitleValueCell edit:Nil];
+    specifier.userInfo = value ?: @"";
+    return specifier;
+}
+
+- (NSString *)latencyText:(NSDictionary<NSString *, NSNumber *> *)percentiles {
+    if (percentiles == nil) {
+        return @"-";
+    }
+    return [NSString stringWithFormat:@"%g / %g / %g ms", percentiles[@"P50"].doubleValue, percentiles[@"P90"].doubleValue, percentiles[@"P99"].doubleValue];
+}
+
+- (id)getValue:(PSSpecifier *)specifier {
+    return specifier.userInfo;
+}
+
+- (void)specifierAction:(PSSpecifier *)specifier {
+    _specifiers = nil;
+    [self reloadSpecifiers];
+}
+
+@end
@@ -0,0 +1,211 @@
+#include <atomic>
+#include <stdio.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define StatsTableFile "/var/tmp/me.qusic.skia.stats"
+
+// Connection metrics of every application and proxy, kept by skiad in a
+// memory mapped file only it can read or write, so they survive restarts of
+// the daemon. Injected processes add up their metrics on their own and send
+// them to skiad as reports. Entries are claimed once and never released and
+// counters only grow.
+struct stats_table {
+    enum counter {
+        decisions_cached,
+        decisions_rules,
+        decisions_script,
+        decisions_evicted, // cached decisions dropped to make room
+        connects_direct,
+        connects_proxied,
+        failures_direct,
+        failures_proxied,
+        counter_count,
+    };
+    enum histogram {
+        decision_cached_usec,
+        decision_evaluated_usec, // rules or script
+        direct_connect_usec,
+        proxy_connect_usec,
+        proxy_handshake_usec, // greeting and connect request
+        histogram_count,
+    };
+    enum proxy_counter {
+        proxy_connects,
+        proxy_failures_connect,
+        proxy_failures_greeting,
+        proxy_failures_reply, // before a reply code, such as the proxy closing
+        proxy_failures_code, // followed by one counter per socks reply code 1 to 8, then unknown codes
+        proxy_counter_count = proxy_failures_code + 9,
+    };
+    enum proxy_histogram {
+        proxy_histogram_connect_usec,
+        proxy_histogram_handshake_usec,
+        proxy_histogram_count,
+    };
+    // bucket i counts samples from 2^(i+6) up to 2^(i+7) microseconds, the
+    // first and the last buckets take everything below and above
+    static const uint32_t bucket_count = 16;
+    static const uint32_t name_size = 64;
+    struct app_entry {
+        std::atomic<uint32_t> state; // 0 free, 1 named
+        char name[name_size]; // NUL terminated
+        std::atomic<uint32_t> counters[counter_count];
+        std::atomic<uint32_t> histograms[histogram_count][bucket_count];
+    };
+    struct proxy_entry {
+        std::atomic<uint32_t> state;
+        uint32_t addr; // network byte order
+        uint32_t port; // network byte order
+        std::atomic<uint32_t> counters[proxy_counter_count];
+        std::atomic<uint32_t> histograms[proxy_histogram_count][bucket_count];
+    };
+    // What a process counted since its last report, followed by at most
+    // proxy_count proxy reports.
+    struct report {
+        char name[name_size];
+        uint32_t counters[counter_count];
+        uint32_t histograms[histogram_count][bucket_count];
+    };
+    struct proxy_report {
+        uint32_t addr; // network byte order
+        uint32_t port; // network byte order
+        uint32_t counters[proxy_counter_count];
+        uint32_t histograms[proxy_histogram_count][bucket_count];
+    };
+    static const int32_t report_message = 1; // message id of reports on SharedTablePort
+    static const uint32_t magic_value = 0x736b6973;
+    static const uint32_t app_count = 128;
+    static const uint32_t proxy_count = 32;
+    std::atomic<uint32_t> magic;
+    uint32_t capacity;
+    app_entry apps[app_count];
+    proxy_entry proxies[proxy_count];
+
+    static uint32_t bucket(uint32_t usec) {
+        uint32_t log2 = usec == 0 ? 0 : 31 - __builtin_clz(usec);
+        return log2 <= 6 ? 0 : log2 - 6 >= bucket_count ? bucket_count - 1 : log2 - 6;
+    }
+
+    // Finds the entry of the application, claiming a free one the first time.
+    // Returns NULL once every entry is taken.
+    app_entry *app(const char *name) {
+        for (app_entry &e : apps) {
+            if (e.state.load(std::memory_order_acquire) == 0) {
+                strlcpy(e.name, name, sizeof(e.name));
+                e.state.store(1, std::memory_order_release);
+                return &e;
+            }
+            if (strncmp(e.name, name, sizeof(e.name)) == 0) {
+                return &e;
+            }
+        }
+        return NULL;
+    }
+
+    proxy_entry *proxy(uint32_t addr, uint32_t port) {
+        for (proxy_entry &e : proxies) {
+            if (e.state.load(std::memory_order_acquire) == 0) {
+                e.addr = addr;
+                e.port = port;
+                e.state.store(1, std::memory_order_release);
+                return &e;
+            }
+            if (e.addr == addr && e.port == port) {
+                return &e;
+            }
+        }
+        return NULL;
+    }
+
+    // Adds a report as received from any process, so nothing in it is trusted
+    // beyond its size.
+    bool add(const void *data, size_t length) {
+        if (length < sizeof(report) || (length - sizeof(report)) % sizeof(proxy_report) != 0 || (length - sizeof(report)) / sizeof(proxy_report) > proxy_count) {
+            return false;
+        }
+        const uint8_t *bytes = reinterpret_cast<const uint8_t *>(data);
+        report r;
+        memcpy(&r, bytes, sizeof(r));
+        r.name[name_size - 1] = '\0';
+        app_entry *a = r.name[0] != '\0' ? app(r.name) : NULL;
+        for (uint32_t i = 0; a != NULL && i < counter_count; i++) {
+            a->counters[i].fetch_add(r.counters[i], std::memory_order_relaxed);
+        }
+        for (uint32_t i = 0; a != NULL && i < histogram_count; i++) {
+            for (uint32_t j = 0; j < bucket_count; j++) {
+                a->histograms[i][j].fetch_add(r.histograms[i][j], std::memory_order_relaxed);
+            }
+        }
+        for (size_t offset = sizeof(report); offset < length; offset += sizeof(proxy_report)) {
+            proxy_report p;
+            memcpy(&p, bytes + offset, sizeof(p));
+            proxy_entry *e = proxy(p.addr, p.port);
+            for (uint32_t i = 0; e != NULL && i < proxy_counter_count; i++) {
+                e->counters[i].fetch_add(p.counters[i], std::memory_order_relaxed);
+            }
+            for (uint32_t i = 0; e != NULL && i < proxy_histogram_count; i++) {
+                for (uint32_t j = 0; j < bucket_count; j++) {
+                    e->histograms[i][j].fetch_add(p.histograms[i][j], std::memory_order_relaxed);
+                }
+            }
+        }
+        return true;
+    }
+
+    // skiad keeps a valid file it owns that nobody else can open, and
+    // otherwise builds a new one and moves it in place with rename, so it
+    // never writes through a file somebody else created.
+    static stats_table *map() {
+        int fd = open(StatsTableFile, O_RDWR);
+        struct stat file_stat;
+        if (fd != -1 && fstat(fd, &file_stat) != 0) {
+            close(fd);
+            fd = -1;
+        }
+        if (fd != -1 && (file_stat.st_size != sizeof(stats_table) || (file_stat.st_mode & 077) != 0 || file_stat.st_uid != geteuid())) {
+            close(fd);
+            fd = -1;
+        }
+        if (fd != -1) {
+            uint32_t header[2] = {0, 0};
+            if (pread(fd, header, sizeof(header), 0) != sizeof(header) || header[0] != magic_value || header[1] != app_count) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        bool created = false;
+        if (fd == -1) {
+            const char *new_file = StatsTableFile ".new";
+            unlink(new_file);
+            fd = open(new_file, O_RDWR | O_CREAT | O_EXCL, 0600);
+            if (fd == -1) {
+                return NULL;
+            }
+            if (fchmod(fd, 0600) != 0 || ftruncate(fd, sizeof(stats_table)) != 0 || rename(new_file, StatsTableFile) != 0) {
+                close(fd);
+                unlink(new_file);
+                return NULL;
+            }
+            created = true;
+        }
+        void *memory = mmap(NULL, sizeof(stats_table), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (memory == MAP_FAILED) {
+            return NULL;
+        }
+        stats_table *table = reinterpret_cast<stats_table *>(memory);
+        if (created) {
+            table->capacity = app_count;
+            table->magic.store(magic_value, std::memory_order_release);
+        }
+        if (table->magic.load(std::memory_order_acquire) != magic_value || table->capacity != app_count) {
+            munmap(memory, sizeof(stats_table));
+            return NULL;
+        }
+        return table;
+    }
+};